@@ -0,0 +1,71 @@
+// Write the same multi-block file several times, first with
+// inline dedup off and then with it on, and report the time
+// and how many block writes dedup turned into shared blocks.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define NFILES 8
+#define NBLOCKS 20
+
+char data[BSIZE];
+
+// Write NFILES identical files, then remove them.
+// Returns the ticks spent writing.
+int
+run(void)
+{
+  char path[] = "dedupbench0";
+  int fd, i, j, t0, ticks;
+
+  t0 = uptime();
+  for(i = 0; i < NFILES; i++){
+    path[10] = '0' + i;
+    fd = open(path, O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf(2, "dedupbench: cannot create %s\n", path);
+      exit();
+    }
+    for(j = 0; j < NBLOCKS; j++){
+      // Blocks differ within a file but repeat across files.
+      memset(data, 'a' + j, sizeof(data));
+      if(write(fd, data, sizeof(data)) != sizeof(data)){
+        printf(2, "dedupbench: write failed\n");
+        exit();
+      }
+    }
+    close(fd);
+  }
+  ticks = uptime() - t0;
+
+  for(i = 0; i < NFILES; i++){
+    path[10] = '0' + i;
+    unlink(path);
+  }
+  return ticks;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct dedup_stats before, after;
+  int old, ticks;
+
+  old = dedup(0, 0);
+  ticks = run();
+  printf(1, "dedupbench: dedup off: %d blocks in %d ticks\n",
+         NFILES*NBLOCKS, ticks);
+
+  dedup(1, &before);
+  ticks = run();
+  dedup(old, &after);
+  printf(1, "dedupbench: dedup on: %d blocks in %d ticks, "
+         "%d of %d lookups shared a block, %d mismatches\n",
+         NFILES*NBLOCKS, ticks, after.hits - before.hits,
+         after.lookups - before.lookups,
+         after.mismatches - before.mismatches);
+  exit();
+}
@@ -0,0 +1,45 @@
+// Offline deduplication: walk every file, merging its blocks
+// and those of its versions with identical blocks elsewhere.
+// Runs at the lowest priority, and sleeps between files so it
+// stays in the background.
+//
+//   dedupd [-l] [delay]
+//
+// delay is in ticks (default 1); -l keeps scanning forever.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "fs.h"
+
+int
+main(int argc, char *argv[])
+{
+  int loop, delay, inum, r, files, freed;
+
+  loop = 0;
+  delay = 1;
+  if(argc > 1 && strcmp(argv[1], "-l") == 0){
+    loop = 1;
+    argc--;
+    argv++;
+  }
+  if(argc > 1)
+    delay = atoi(argv[1]);
+  setpriority(getpid(), NPRIO-1);
+
+  do {
+    files = freed = 0;
+    for(inum = 1; (r = dedup_scan(inum)) >= 0; inum++){
+      freed += r;
+      files++;
+      if(delay > 0)
+        sleep(delay);
+    }
+    printf(1, "dedupd: scanned %d inodes, reclaimed %d bytes\n",
+           files, freed*BSIZE);
+  } while(loop);
+
+  exit();
+}
@@ -6,6 +6,7 @@ struct pipe;
 struct proc;
 struct rtcdate;
 struct spinlock;
+struct rwlock;
 struct sleeplock;
 struct stat;
 struct superblock;
@@ -14,6 +15,10 @@ struct snapshot_metadata;
 struct recovery_entry;
 struct deleted_entry;
 struct version_node;
+struct diff_entry;
+struct dedup_stats;
+struct retention;
+struct lockstat;
 
 // bio.c
 void            binit(void);
@@ -46,12 +51,15 @@ struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
+int             iinuse(uint, uint);
+void            iinvalidate(void);
 void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
+int             fullpath(char*, char*, int);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
@@ -61,31 +69,42 @@ int             writei(struct inode*, char*, uint, uint);
 // ChronoFS: Version management (fs.c)
 uint            version_create(struct inode*, char*, uint, uint);
 struct version_node* version_get(uint);
+void            version_put(struct version_node*);
+void            version_invalidate(uint);
+int             version_restore(struct inode*, struct version_node*);
 int             version_list(struct inode*, struct version_info*, int);
-void            init_deleted_list(void);
-void            add_deleted_file(char*, uint, uint);
-struct deleted_entry* find_deleted_file(char*);
-uint            recover_deleted_file(char*);
-void            version_free(uint);
+void            version_release(uint);
 uint            get_timestamp(void);
 uint            balloc(uint);
+uint            ballocsnap(uint);
+uint            bfreecount(void);
 void            bfree(int, uint);
+int             bdrop(uint, uint);
+void            bmapdrop(uint, uint*, uint);
+void            bcountinit(int);
+int             dedup_scan(uint);
+int             version_prune(struct inode*, struct retention*, int);
+int             version_prune_inum(uint, struct retention*);
+int             version_setpolicy(struct inode*, struct retention*);
+int             version_reclaim(void);
 
 // ChronoFS: snapshot.c
 void            snapshot_init(void);
+void            snapshot_cow(struct buf*);
 int             snapshot_create(char*);
 int             snapshot_restore(char*);
 int             snapshot_delete(char*);
 int             snapshot_list(struct snapshot_metadata*, int);
+int             snapshot_diff(char*, char*, struct diff_entry*, int);
+int             version_diff(struct inode*, int, int, struct diff_entry*, int);
 
 // ChronoFS: recovery.c
 void            recovery_init(void);
-int             recover_file(char*, uint);
+int             recovery_register_deletion(struct inode*, char*);
+int             recovery_find_deleted(char*, struct deleted_entry*);
+uint            recovery_clear_entry(char*);
 int             undelete_file(char*);
-int             list_recoverable(struct recovery_entry*, int);
-int             list_deleted(struct deleted_entry*, int);
-struct inode*   get_file_at_time(char*, uint);
-int             list_versions(char*, struct version_info*, int);
+int             list_deleted(uint*, struct deleted_entry*, int);
 
 // ChronoFS: journal.c
 void            journal_init(void);
@@ -100,13 +119,26 @@ void            gc_init(void);
 void            bref_init(void);
 int             bref_inc(uint);
 int             bref_dec(uint);
+int             bref_share(uint);
+int             bref_share_live(uint);
+int             bref_drop(uint);
 int             bref_is_tracked(uint);
 uint            bref_get(uint);
+void            bref_commit(void);
 void            dedup_init(void);
-uint            dedup_hash(char*, uint);
-uint            dedup_find(uint);
-int             dedup_insert(uint, uint);
+uint64          dedup_hash(char*, uint);
+uint            dedup_find(uint64);
+int             dedup_insert(uint64, uint);
+int             dedup_remove(uint64, uint);
+int             dedup_live(uint);
+void            dedup_forget(uint);
+int             dedup_config(int, struct dedup_stats*);
 int             gc_run(void);
+void            gc_push(uint);
+void            gc_wakeup(void);
+int             gc_reclaim(uint);
+void            retention_get(struct retention*);
+void            retention_set(struct retention*);
 
 
 // ide.c
@@ -121,9 +153,11 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kzinit(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -135,12 +169,15 @@ extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
 void            lapicstartap(uchar, uint);
+void            lapicipi(uchar, int);
+void            lapictimer(int);
 void            microdelay(int);
 
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
 void            begin_op();
+void            begin_op_exclusive(void);
 void            end_op();
 
 // mp.c
@@ -159,19 +196,24 @@ int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+void            boost(void);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+struct proc*    kthread(char*, void(*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             setaffinity(int, uint);
+int             setpriority(int, int);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
+int             timeslice(void);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -185,10 +227,19 @@ void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+int             lockstat(struct lockstat*, int);
 void            release(struct spinlock*);
 void            pushcli(void);
 void            popcli(void);
 
+// rwlock.c
+void            acquireread(struct rwlock*);
+void            acquirewrite(struct rwlock*);
+int             holdingwrite(struct rwlock*);
+void            initrwlock(struct rwlock*, char*);
+void            releaseread(struct rwlock*);
+void            releasewrite(struct rwlock*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
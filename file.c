@@ -11,6 +11,8 @@
 #include "file.h"
 
 struct devsw devsw[NDEV];
+extern struct superblock sb;
+
 struct {
   struct spinlock lock;
   struct file file[NFILE];
@@ -132,6 +134,7 @@ filewrite(struct file *f, char *addr, int n)
     // might be writing a device like the console.
     int max = ((MAXOPBLOCKS-1-1-2) / 2) * 512;
     int i = 0;
+    int stuck = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
@@ -146,9 +149,18 @@ filewrite(struct file *f, char *addr, int n)
 
       if(r < 0)
         break;
-      if(r != n1)
-        panic("short filewrite");
       i += r;
+      if(r == n1)
+        continue;
+      // Out of blocks: make room by reclaiming old versions
+      // (outside the transaction), then write the rest. Give
+      // up if the last attempt after reclaiming wrote nothing.
+      if(r == 0 && stuck++)
+        break;
+      if(r > 0)
+        stuck = 0;
+      if(gc_reclaim(BRESERVE(sb) + MAXOPBLOCKS) < 0)
+        break;
     }
     return i == n ? n : -1;
   }
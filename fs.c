@@ -17,6 +17,7 @@
 #include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rwlock.h"
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
@@ -24,6 +25,7 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void vcacheinit(void);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -53,13 +55,36 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Number of free blocks, for the gc watermark.
+struct {
+  struct spinlock lock;
+  uint n;
+} nfree;
+
+// Number of free blocks.
 uint
-balloc(uint dev)
+bfreecount(void)
 {
-  int b, bi, m;
+  uint n;
+
+  acquire(&nfree.lock);
+  n = nfree.n;
+  release(&nfree.lock);
+  return n;
+}
+
+// Allocate a zeroed disk block, leaving reserve blocks free.
+// Returns 0 if there are no more.
+static uint
+balloc1(uint dev, uint reserve)
+{
+  int b, bi, m, low;
   struct buf *bp;
 
+  if(bfreecount() <= reserve){
+    gc_wakeup();
+    return 0;
+  }
   bp = 0;
   for(b = 0; b < sb.size; b += BPB){
     bp = bread(dev, BBLOCK(b, sb));
@@ -70,12 +95,34 @@ balloc(uint dev)
         log_write(bp);
         brelse(bp);
         bzero(dev, b + bi);
+        acquire(&nfree.lock);
+        low = --nfree.n < GC_LOWMARK(sb);
+        release(&nfree.lock);
+        if(low)
+          gc_wakeup();
         return b + bi;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  gc_wakeup();
+  return 0;
+}
+
+// Allocate a zeroed disk block.
+// Returns 0 if the disk is full.
+uint
+balloc(uint dev)
+{
+  return balloc1(dev, BRESERVE(sb));
+}
+
+// Like balloc(), but may use the blocks held back for
+// snapshot_cow().
+uint
+ballocsnap(uint dev)
+{
+  return balloc1(dev, 0);
 }
 
 // Free a disk block.
@@ -93,6 +140,30 @@ bfree(int dev, uint b)
   bp->data[bi/8] &= ~m;
   log_write(bp);
   brelse(bp);
+  dedup_forget(b);
+  acquire(&nfree.lock);
+  nfree.n++;
+  release(&nfree.lock);
+}
+
+// Count the free blocks in the bitmap.
+// Called once the log has been recovered.
+void
+bcountinit(int dev)
+{
+  struct buf *bp;
+  int b, bi;
+
+  initlock(&nfree.lock, "nfree");
+  nfree.n = 0;
+  for(b = 0; b < sb.size; b += BPB){
+    bp = bread(dev, BBLOCK(b, sb));
+    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+        nfree.n++;
+    }
+    brelse(bp);
+  }
 }
 
 // Inodes.
@@ -155,17 +226,22 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// The icache.lock reader-writer lock protects the allocation
+// of icache entries. Since ip->ref indicates whether an entry
+// is free, and ip->dev and ip->inum indicate which i-node an
+// entry holds, one must hold icache.lock while using any of
+// those fields. Recycling an entry, or changing its dev and
+// inum, needs it for writing. Holding it for reading is enough
+// to look entries up and to change ref atomically, as long as
+// a free entry (ref 0) is never taken that way: so lookups,
+// which are most of the traffic, do not serialize.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
 struct {
-  struct spinlock lock;
+  struct rwlock lock;
   struct inode inode[NINODE];
 } icache;
 
@@ -174,16 +250,18 @@ iinit(int dev)
 {
   int i = 0;
   
-  initlock(&icache.lock, "icache");
+  initrwlock(&icache.lock, "icache");
   for(i = 0; i < NINODE; i++) {
     initsleeplock(&icache.inode[i].lock, "inode");
   }
 
+  vcacheinit();
+
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
- inodestart %d bmap start %d\n", sb.size, sb.nblocks,
-          sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
-          sb.bmapstart);
+ inodestart %d bmap start %d refstart %d delstart %d\n", sb.size,
+          sb.nblocks, sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
+          sb.bmapstart, sb.refstart, sb.delstart);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -199,17 +277,16 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
+  // Inodes from SNAPSHOT_INODE_START on are reserved for snapshots.
+  for(inum = 1; inum < sb.ninodes && inum < SNAPSHOT_INODE_START; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
+      snapshot_cow(bp);
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       
-      extern uint ticks;
-      acquire(&tickslock);
-      dip->create_time = ticks;
-      release(&tickslock);
+      dip->create_time = get_timestamp();
       dip->version_head = 0;
       
       log_write(bp);   // mark it allocated on the disk
@@ -232,6 +309,7 @@ iupdate(struct inode *ip)
   struct dinode *dip;
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
+  snapshot_cow(bp);
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
   dip->major = ip->major;
@@ -255,15 +333,31 @@ static struct inode*
 iget(uint dev, uint inum)
 {
   struct inode *ip, *empty;
+  int r;
 
-  acquire(&icache.lock);
+  // Is the inode already cached and in use?
+  acquireread(&icache.lock);
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    if(ip->dev != dev || ip->inum != inum)
+      continue;
+    // Take a reference unless the last one has just gone.
+    while((r = ip->ref) > 0){
+      if(__sync_val_compare_and_swap(&ip->ref, r, r + 1) == r){
+        releaseread(&icache.lock);
+        return ip;
+      }
+    }
+  }
+  releaseread(&icache.lock);
 
-  // Is the inode already cached?
+  // Not found: look again, since it may have been added since,
+  // and recycle an entry if not.
+  acquirewrite(&icache.lock);
   empty = 0;
   for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
     if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
       ip->ref++;
-      release(&icache.lock);
+      releasewrite(&icache.lock);
       return ip;
     }
     if(empty == 0 && ip->ref == 0)    // Remember empty slot.
@@ -279,7 +373,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&icache.lock);
+  releasewrite(&icache.lock);
 
   return ip;
 }
@@ -289,9 +383,9 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
-  ip->ref++;
-  release(&icache.lock);
+  acquireread(&icache.lock);
+  __sync_fetch_and_add(&ip->ref, 1);
+  releaseread(&icache.lock);
   return ip;
 }
 
@@ -351,12 +445,14 @@ iput(struct inode *ip)
 {
   acquiresleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
-    acquire(&icache.lock);
+    acquireread(&icache.lock);
     int r = ip->ref;
-    release(&icache.lock);
+    releaseread(&icache.lock);
     if(r == 1){
       // inode has no links and no other references: truncate and free.
       itrunc(ip);
+      version_release(ip->version_head);
+      ip->version_head = 0;
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
@@ -364,9 +460,48 @@ iput(struct inode *ip)
   }
   releasesleep(&ip->lock);
 
-  acquire(&icache.lock);
-  ip->ref--;
-  release(&icache.lock);
+  acquireread(&icache.lock);
+  __sync_fetch_and_sub(&ip->ref, 1);
+  releaseread(&icache.lock);
+}
+
+// Is inode inum on dev held in the cache by anyone?
+int
+iinuse(uint dev, uint inum)
+{
+  struct inode *ip;
+  int r = 0;
+
+  acquireread(&icache.lock);
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+      r = 1;
+      break;
+    }
+  }
+  releaseread(&icache.lock);
+  return r;
+}
+
+// Make every cached inode reread itself from disk at its
+// next ilock(). Used after the on-disk inode table has been
+// replaced underneath the cache (snapshot rollback).
+void
+iinvalidate(void)
+{
+  struct inode *ip;
+  int r;
+
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    acquireread(&icache.lock);
+    r = ip->ref;
+    releaseread(&icache.lock);
+    if(r == 0)
+      continue;
+    acquiresleep(&ip->lock);
+    ip->valid = 0;
+    releasesleep(&ip->lock);
+  }
 }
 
 // Common idiom: unlock, then put.
@@ -387,6 +522,7 @@ iunlockput(struct inode *ip)
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
+// Returns 0 if the disk is full.
 static uint
 bmap(struct inode *ip, uint bn)
 {
@@ -402,8 +538,11 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->indirect) == 0)
-      ip->indirect = addr = balloc(ip->dev);
+    if((addr = ip->indirect) == 0){
+      if((addr = balloc(ip->dev)) == 0)
+        return 0;
+      ip->indirect = addr;
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
@@ -417,46 +556,255 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
-// Truncate inode (discard contents).
-// Only called when the inode has no links
-// to it (no directory entries referring to it)
-// and has no in-memory reference to it (is
-// not an open file or current directory).
-static void
-itrunc(struct inode *ip)
+// ChronoFS: copy-on-write.
+// Give the caller a private copy of shared block b and drop
+// the caller's reference to b. Returns the copy, or 0 (with
+// b untouched) if the disk is full.
+static uint
+bcow(uint dev, uint b)
+{
+  uint copy;
+  struct buf *from, *to;
+
+  if((copy = balloc(dev)) == 0)
+    return 0;
+  from = bread(dev, b);
+  to = bread(dev, copy);
+  memmove(to->data, from->data, BSIZE);
+  log_write(to);
+  brelse(from);
+  brelse(to);
+
+  bref_dec(b);
+  return copy;
+}
+
+// Give ip a private copy of its indirect block if it is
+// shared, so its entries can change.
+// Returns -1 if the disk is full.
+static int
+bunshareind(struct inode *ip)
+{
+  struct buf *bp;
+  uint copy, *a;
+  int j;
+
+  if(ip->indirect == 0 || bref_get(ip->indirect) <= 1)
+    return 0;
+  if((copy = bcow(ip->dev, ip->indirect)) == 0)
+    return -1;
+  ip->indirect = copy;
+  iupdate(ip);
+  // The copy is a second pointer to every block it lists.
+  bp = bread(ip->dev, ip->indirect);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j])
+      bref_share(a[j]);
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Like bmap, but for writing: any block on the path to the
+// nth block that is still shared with a version or snapshot
+// (refcount > 1) is copied first, so only ip sees the write.
+// Returns 0 if the disk is full.
+static uint
+bmapw(struct inode *ip, uint bn)
+{
+  uint addr, *a;
+  struct buf *bp;
+
+  if(bn < NDIRECT){
+    if((addr = bmap(ip, bn)) != 0 && bref_get(addr) > 1){
+      if((addr = bcow(ip->dev, addr)) == 0)
+        return 0;
+      ip->addrs[bn] = addr;
+      iupdate(ip);
+    }
+    return addr;
+  }
+
+  // Unshare the indirect block before bmap() can add to it.
+  if(bunshareind(ip) < 0)
+    return 0;
+
+  if((addr = bmap(ip, bn)) != 0 && bref_get(addr) > 1){
+    if((addr = bcow(ip->dev, addr)) == 0)
+      return 0;
+    bp = bread(ip->dev, ip->indirect);
+    a = (uint*)bp->data;
+    a[bn - NDIRECT] = addr;
+    log_write(bp);
+    brelse(bp);
+  }
+  return addr;
+}
+
+// Drop one reference to data block b, freeing it
+// once no version shares it any more.
+// Returns 1 if it freed b.
+int
+bdrop(uint dev, uint b)
+{
+  if(bref_drop(b) == 0){
+    bfree(dev, b);
+    return 1;
+  }
+  return 0;
+}
+
+// Drop the references held by a block map of NDIRECT
+// direct blocks plus an indirect block.
+// A shared indirect block still owns what it lists.
+void
+bmapdrop(uint dev, uint *addrs, uint indirect)
 {
   int i, j;
   struct buf *bp;
   uint *a;
 
-  // Free direct blocks
   for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      // ChronoFS: Only use refcount for recovered files
-      // Normal files just free blocks directly
-      if(bref_is_tracked(ip->addrs[i])){
-        if(bref_dec(ip->addrs[i]) == 0){
-          bfree(ip->dev, ip->addrs[i]);
-        }
-      } else {
-        bfree(ip->dev, ip->addrs[i]);
+    if(addrs[i])
+      bdrop(dev, addrs[i]);
+  }
+
+  if(indirect){
+    if(bref_get(indirect) <= 1){
+      bp = bread(dev, indirect);
+      a = (uint*)bp->data;
+      for(j = 0; j < NINDIRECT; j++){
+        if(a[j])
+          bdrop(dev, a[j]);
       }
-      ip->addrs[i] = 0;
+      brelse(bp);
+    }
+    bdrop(dev, indirect);
+  }
+}
+
+// Return the address of the nth block of ip,
+// or 0 if it has none. Allocates nothing.
+static uint
+bpeek(struct inode *ip, uint bn)
+{
+  uint addr;
+  struct buf *bp;
+
+  if(bn < NDIRECT)
+    return ip->addrs[bn];
+  if(ip->indirect == 0)
+    return 0;
+  bp = bread(ip->dev, ip->indirect);
+  addr = ((uint*)bp->data)[bn - NDIRECT];
+  brelse(bp);
+  return addr;
+}
+
+// ChronoFS: deduplication.
+// Look in the dedup index for a live block other than
+// self whose bytes are exactly src (one full block with
+// fingerprint fp), and take a reference on it; the block is
+// then shared, so no owner can change it in place.
+// Returns the block, or 0 if there is none.
+static uint
+bdupget(uint dev, char *src, uint64 fp, uint self)
+{
+  uint b;
+  struct buf *bp;
+
+  __sync_fetch_and_add(&dedup_statistics.lookups, 1);
+  if((b = dedup_find(fp)) == 0 || b == self)
+    return 0;
+  if(!dedup_live(b)){
+    dedup_remove(fp, b);
+    return 0;
+  }
+
+  // Hold b while comparing and sharing it: writei() rechecks
+  // b's refcount under the same buffer lock before writing to
+  // it in place.
+  bp = bread(dev, b);
+  if(memcmp(bp->data, src, BSIZE) != 0){
+    // Fingerprint collision, or b was rewritten in place
+    // since it was indexed.
+    brelse(bp);
+    __sync_fetch_and_add(&dedup_statistics.mismatches, 1);
+    dedup_remove(fp, b);
+    return 0;
+  }
+  if(!dedup_live(b)){
+    // Freed, and perhaps reused for metadata with the same
+    // bytes, while we read it. Writing b needs the buffer
+    // lock we hold, and it cannot be reused again before our
+    // transaction commits.
+    brelse(bp);
+    dedup_remove(fp, b);
+    return 0;
+  }
+  if(bref_share_live(b) < 0){
+    // Freed by a racing truncate.
+    brelse(bp);
+    return 0;
+  }
+  brelse(bp);
+  __sync_fetch_and_add(&dedup_statistics.hits, 1);
+  return b;
+}
+
+// Make an identical indexed block the nth block of ip instead
+// of storing src there. Caller must hold ip->lock and be inside
+// a transaction. Returns -1 if there is no such block, 1 if the
+// block it replaced was freed, and 0 otherwise.
+static int
+bdedup(struct inode *ip, uint bn, char *src, uint64 fp)
+{
+  uint b, old, *a;
+  struct buf *bp;
+
+  // Make room for the new pointer first, so nothing needs
+  // undoing if the disk is full.
+  if(bn >= NDIRECT){
+    if(bunshareind(ip) < 0)
+      return -1;
+    if(ip->indirect == 0){
+      if((ip->indirect = balloc(ip->dev)) == 0)
+        return -1;
+      iupdate(ip);
     }
   }
 
-  // Free indirect block and its contents
-  if(ip->indirect){
+  old = bpeek(ip, bn);
+  if((b = bdupget(ip->dev, src, fp, old)) == 0)
+    return -1;
+
+  if(bn < NDIRECT){
+    ip->addrs[bn] = b;
+    iupdate(ip);
+  } else {
     bp = bread(ip->dev, ip->indirect);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
+    a[bn - NDIRECT] = b;
+    log_write(bp);
     brelse(bp);
-    bfree(ip->dev, ip->indirect);
-    ip->indirect = 0;
   }
+  return old ? bdrop(ip->dev, old) : 0;
+}
+
+// Truncate inode (discard contents).
+// Called when the inode has no links
+// to it (no directory entries referring to it)
+// and has no in-memory reference to it (is
+// not an open file or current directory),
+// and by version_restore() before it remaps ip.
+static void
+itrunc(struct inode *ip)
+{
+  // ChronoFS: blocks shared with versions are refcounted
+  bmapdrop(ip->dev, ip->addrs, ip->indirect);
+  memset(ip->addrs, 0, sizeof(ip->addrs));
+  ip->indirect = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -480,7 +828,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -495,22 +843,28 @@ readi(struct inode *ip, char *dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    if((addr = bmap(ip, off/BSIZE)) == 0)
+      break;
+    bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
-  return n;
+  return tot;
 }
 
 // PAGEBREAK!
 // Write data to inode.
 // Caller must hold ip->lock.
+// Returns the number of bytes written, which is short
+// if the disk fills up.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addr;
+  uint64 fp;
   struct buf *bp;
+  int dedup;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
@@ -524,18 +878,36 @@ writei(struct inode *ip, char *src, uint off, uint n)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
+    dedup = dedup_enabled && ip->type == T_FILE && m == BSIZE;
+    if(dedup){
+      fp = dedup_hash(src, BSIZE);
+      if(bdedup(ip, off/BSIZE, src, fp) >= 0)
+        continue;
+    }
+    for(;;){
+      if((addr = bmapw(ip, off/BSIZE)) == 0)
+        goto full;
+      bp = bread(ip->dev, addr);
+      // bdedup() in another file may have shared addr since
+      // bmapw() looked; it cannot while we hold bp.
+      if(bref_get(addr) <= 1)
+        break;
+      brelse(bp);
+    }
     memmove(bp->data + off%BSIZE, src, m);
     log_write(bp);
     brelse(bp);
+    if(dedup)
+      dedup_insert(fp, addr);
   }
 
-  if(n > 0 && off > ip->size){
+full:
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot;
 }
 
 //PAGEBREAK!
@@ -600,7 +972,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+    return -1;
 
   return 0;
 }
@@ -697,18 +1069,123 @@ nameiparent(char *path, char *name)
   return namex(path, 1, name);
 }
 
+// Append the elements of path to the absolute path in buf,
+// which has length *len (0 for the root) and room for n bytes,
+// resolving "." and "..". Returns -1 if it does not fit.
+static int
+pathappend(char *buf, int *len, int n, char *path)
+{
+  char name[DIRSIZ];
+  int l;
+
+  while((path = skipelem(path, name)) != 0){
+    if(namecmp(name, ".") == 0)
+      continue;
+    if(namecmp(name, "..") == 0){
+      while(*len > 0 && buf[--*len] != '/')
+        ;
+      continue;
+    }
+    for(l = 0; l < DIRSIZ && name[l]; l++)
+      ;
+    if(*len + 1 + l >= n)
+      return -1;
+    buf[(*len)++] = '/';
+    memmove(buf + *len, name, l);
+    *len += l;
+  }
+  return 0;
+}
+
+// Write the absolute path of the current directory into buf,
+// by looking each directory up in its parent. Returns its
+// length (0 for the root), or -1 if it does not fit in n bytes
+// or the directory has been removed.
+// Must be called inside a transaction since it calls iput().
+static int
+cwdpath(char *buf, int n)
+{
+  struct inode *ip, *pp;
+  struct dirent de;
+  uint inum, off;
+  int pos, l, found;
+
+  pos = n;
+  ip = idup(myproc()->cwd);
+  for(;;){
+    ilock(ip);
+    inum = ip->inum;
+    if(inum == ROOTINO){
+      iunlockput(ip);
+      break;
+    }
+    pp = dirlookup(ip, "..", 0);
+    iunlockput(ip);
+    if(pp == 0)
+      return -1;
+
+    // Only one directory is locked at a time, as in namex().
+    ilock(pp);
+    found = 0;
+    for(off = 0; off < pp->size && !found; off += sizeof(de)){
+      if(readi(pp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("cwdpath read");
+      found = de.inum == inum && namecmp(de.name, ".") != 0 &&
+              namecmp(de.name, "..") != 0;
+    }
+    iunlock(pp);
+    for(l = 0; l < DIRSIZ && de.name[l]; l++)
+      ;
+    // Keep a byte free for the terminating NUL.
+    if(!found || pos <= l + 1){
+      iput(pp);
+      return -1;
+    }
+    pos -= l;
+    memmove(buf + pos, de.name, l);
+    buf[--pos] = '/';
+    ip = pp;
+  }
+  memmove(buf, buf + pos, n - pos);
+  return n - pos;
+}
+
+// Write the absolute form of path, with "." and ".." resolved,
+// into buf, which has room for n bytes. The result need not
+// name an existing file. Returns -1 if it does not fit.
+// Must be called inside a transaction since it calls iput().
+int
+fullpath(char *path, char *buf, int n)
+{
+  int len;
+
+  len = 0;
+  if(*path != '/' && (len = cwdpath(buf, n)) < 0)
+    return -1;
+  if(pathappend(buf, &len, n, path) < 0)
+    return -1;
+  if(len == 0)
+    buf[len++] = '/';
+  buf[len] = 0;
+  return 0;
+}
+
 //PAGEBREAK!
 // ChronoFS: Version Management
 
-// Get current timestamp
+// Most versions version_prune() may drop in one transaction:
+// each rewrites the newer node's link, and queueing the dropped
+// node writes it and the superblock. Creating a version has
+// already used three blocks of its transaction.
+#define PRUNE_SLICE  ((MAXOPBLOCKS-1)/2)
+#define PRUNE_INLINE ((MAXOPBLOCKS-4)/2)
+
+// Get current timestamp.
+// ticks is one aligned word, so reading it needs no lock.
 uint
 get_timestamp(void)
 {
-  extern uint ticks;
-  acquire(&tickslock);
-  uint t = ticks;
-  release(&tickslock);
-  return t;
+  return *(volatile uint*)&ticks;
 }
 
 // Create a new version node for a file
@@ -716,8 +1193,8 @@ get_timestamp(void)
 uint
 version_create(struct inode *ip, char *description, uint desc_len, uint snapshot_id)
 {
-  struct buf *bp;
-  struct version_node *vnode;
+  struct buf *bp, *dbp;
+  struct version_node *vnode, *prev;
   uint vblock;
   
   // Allocate a block for the version node
@@ -735,27 +1212,30 @@ version_create(struct inode *ip, char *description, uint desc_len, uint snapshot
   vnode->file_size = ip->size;
   vnode->refcount = 1;
   vnode->snapshot_id = snapshot_id;
+  if((prev = version_get(ip->version_head)) != 0){
+    vnode->has_policy = prev->has_policy;
+    vnode->policy = prev->policy;
+    version_put(prev);
+  }
   
-  // Copy data block addresses (Copy-on-Version)
+  // Share data block addresses (Copy-on-Write): the file and
+  // the version point at the same blocks, and writei() copies
+  // a block before the file changes it.
   vnode->nblocks = 0;
   for(int i = 0; i < NDIRECT && i < VNODE_DATA_BLOCKS; i++){
     if(ip->addrs[i]){
-      // Allocate a new block for the version
-      uint newblock = balloc(ip->dev);
-      if(newblock == 0) continue;
-      
-      // Copy data from file block to version block
-      struct buf *src = bread(ip->dev, ip->addrs[i]);
-      struct buf *dst = bread(ip->dev, newblock);
-      memmove(dst->data, src->data, BSIZE);
-      log_write(dst);
-      brelse(src);
-      brelse(dst);
-      
-      vnode->data_blocks[vnode->nblocks++] = newblock;
-      
-      // Increment refcount for the NEW block
-      bref_inc(newblock);
+      if(bref_share(ip->addrs[i]) < 0) continue;
+      vnode->data_blocks[vnode->nblocks++] = ip->addrs[i];
+    }
+  }
+
+  // Shared blocks can no longer change in place, so they are
+  // safe for later writes to deduplicate against.
+  if(dedup_enabled && ip->type == T_FILE){
+    for(uint i = 0; i < vnode->nblocks; i++){
+      dbp = bread(ip->dev, vnode->data_blocks[i]);
+      dedup_insert(dedup_hash((char*)dbp->data, BSIZE), dbp->blockno);
+      brelse(dbp);
     }
   }
   
@@ -771,31 +1251,186 @@ version_create(struct inode *ip, char *description, uint desc_len, uint snapshot
   
   log_write(bp);
   brelse(bp);
+  version_invalidate(vblock);
   
   // Update inode with new version head
   ip->version_head = vblock;
   iupdate(ip);
+
+  // Keep the chain within its retention policy. The gc thread
+  // catches up with whatever this leaves behind.
+  version_prune(ip, 0, PRUNE_INLINE);
   
   return vblock;
 }
 
 
 
-// Get a version node by block number
+// Version node cache.
+//
+// version_get() hands out refcounted, read-only copies of decoded
+// version nodes so that walking a hot version chain does not bread()
+// every node, and so that callers on different CPUs each hold their
+// own stable copy. Entries whose ref has dropped to zero stay cached
+// on an MRU list (like bcache) until they are recycled.
+//
+// vcache.lock protects vblock, ref, valid and the list links.
+// Each entry's sleep-lock serializes the disk read that fills it.
+// Anyone who rewrites or frees a version node block must call
+// version_invalidate() so stale copies are not served.
+
+struct vcnode {
+  struct version_node v;  // must be first: version_put() casts back
+  uint vblock;            // block holding the node, 0 if unused
+  int ref;                // number of version_get() handles
+  int valid;              // v has been read from disk?
+  struct sleeplock lock;  // held while reading v from disk
+  struct vcnode *prev;    // MRU list
+  struct vcnode *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct vcnode node[NVNODE];
+  struct vcnode head;     // head.next is most recently used
+} vcache;
+
+static void
+vcacheinit(void)
+{
+  struct vcnode *n;
+
+  initlock(&vcache.lock, "vcache");
+  vcache.head.prev = &vcache.head;
+  vcache.head.next = &vcache.head;
+  for(n = vcache.node; n < vcache.node+NVNODE; n++){
+    initsleeplock(&n->lock, "vnode");
+    n->next = vcache.head.next;
+    n->prev = &vcache.head;
+    vcache.head.next->prev = n;
+    vcache.head.next = n;
+  }
+}
+
+// Get a version node by block number.
+// Returns a referenced, read-only copy that the caller must
+// release with version_put(), or 0 if vblock is 0.
 struct version_node*
 version_get(uint vblock)
 {
-  static struct version_node vnode;
+  struct vcnode *n;
   struct buf *bp;
-  
+
   if(vblock == 0)
     return 0;
-  
-  bp = bread(ROOTDEV, vblock);
-  memmove(&vnode, bp->data, sizeof(vnode));
-  brelse(bp);
-  
-  return &vnode;
+
+  acquire(&vcache.lock);
+
+  // Is the node already cached?
+  for(n = vcache.head.next; n != &vcache.head; n = n->next){
+    if(n->vblock == vblock){
+      n->ref++;
+      goto found;
+    }
+  }
+
+  // Not cached; recycle the least recently used idle entry.
+  for(n = vcache.head.prev; n != &vcache.head; n = n->prev){
+    if(n->ref == 0){
+      n->vblock = vblock;
+      n->ref = 1;
+      n->valid = 0;
+      goto found;
+    }
+  }
+  panic("version_get: no vnodes");
+
+found:
+  release(&vcache.lock);
+
+  acquiresleep(&n->lock);
+  if(n->valid == 0){
+    bp = bread(ROOTDEV, vblock);
+    memmove(&n->v, bp->data, sizeof(n->v));
+    brelse(bp);
+    n->valid = 1;
+  }
+  releasesleep(&n->lock);
+
+  return &n->v;
+}
+
+// Release a handle returned by version_get().
+void
+version_put(struct version_node *vnode)
+{
+  struct vcnode *n = (struct vcnode*)vnode;
+
+  if(vnode == 0)
+    return;
+
+  acquire(&vcache.lock);
+  if(n->ref < 1)
+    panic("version_put");
+  n->ref--;
+  if(n->ref == 0){
+    // Move to the head of the MRU list.
+    n->next->prev = n->prev;
+    n->prev->next = n->next;
+    n->next = vcache.head.next;
+    n->prev = &vcache.head;
+    vcache.head.next->prev = n;
+    vcache.head.next = n;
+  }
+  release(&vcache.lock);
+}
+
+// Drop any cached copy of the version node in vblock.
+// Must be called whenever that block is rewritten or freed.
+// Existing handles keep their (now detached) copy until put.
+void
+version_invalidate(uint vblock)
+{
+  struct vcnode *n;
+
+  acquire(&vcache.lock);
+  for(n = vcache.head.next; n != &vcache.head; n = n->next){
+    if(n->vblock == vblock){
+      n->vblock = 0;
+      n->valid = 0;
+      break;
+    }
+  }
+  release(&vcache.lock);
+}
+
+// Make ip's content the content captured in vnode.
+// The version's data blocks are shared with ip by reference
+// rather than copied, so this costs no data I/O; writei()
+// copies a shared block before changing it.
+// Caller must hold ip->lock and be inside a transaction.
+// Returns 0 on success, -1 if a block's refcount would overflow
+// (ip then holds only the blocks that could be shared).
+int
+version_restore(struct inode *ip, struct version_node *vnode)
+{
+  uint i;
+
+  itrunc(ip);
+
+  for(i = 0; i < vnode->nblocks && i < NDIRECT; i++){
+    if(vnode->data_blocks[i] == 0)
+      continue;
+    if(bref_inc(vnode->data_blocks[i]) < 0){
+      ip->size = min(vnode->file_size, i*BSIZE);
+      iupdate(ip);
+      return -1;
+    }
+    ip->addrs[i] = vnode->data_blocks[i];
+  }
+  ip->size = vnode->file_size;
+  iupdate(ip);
+  return 0;
 }
 
 // List all versions of a file
@@ -822,155 +1457,413 @@ version_list(struct inode *ip, struct version_info *buf, int max)
     
     count++;
     vblock = vnode->prev_version;
+    version_put(vnode);
   }
   
   return count;
 }
 
-// Snapshot management
-struct snapshot_metadata snapshots[MAX_SNAPSHOTS];
-struct spinlock snapshot_lock;
-
+// Drop a reference to the version chain starting at vblock.
+// The last reference makes the node garbage; the gc thread
+// frees it and its data blocks, then the rest of the chain.
+// Caller must be inside a transaction.
 void
-init_snapshot_list(void)
+version_release(uint vblock)
 {
-  initlock(&snapshot_lock, "snapshots");
-  memset(snapshots, 0, sizeof(snapshots));
+  if(vblock && bref_drop(vblock) == 0)
+    gc_push(vblock);
 }
 
-// Create a system-wide snapshot
-int
-snapshot_create(char *name)
+
+// ChronoFS: offline deduplication.
+//
+// dedup_scan() merges the blocks of one file, and of its
+// versions, with identical blocks already in the dedup index,
+// and indexes the rest. It works in short transactions, each
+// looking at no more than DEDUP_SLICE blocks and merging no more
+// than DEDUP_MERGES of them, and holds ilock() only within one,
+// so foreground writers are never kept waiting for long.
+// A merge may copy the indirect block, and rewrites the inode,
+// the indirect block or a version node, and a bitmap block.
+#define DEDUP_SLICE  8
+#define DEDUP_MERGES ((MAXOPBLOCKS-1)/3)
+
+// Return a referenced inode for inum if it is a regular file.
+static struct inode*
+dedup_iget(uint inum)
 {
-  int i;
-  uint id;
-  
-  acquire(&snapshot_lock);
-  
-  // Find empty slot
-  for(i = 0; i < MAX_SNAPSHOTS; i++){
-    if(!snapshots[i].valid)
-      break;
+  struct buf *bp;
+  struct dinode *dip;
+  struct inode *ip;
+
+  // Holding the inode block keeps ialloc() and iput()
+  // from changing its type until iget() holds a reference.
+  bp = bread(ROOTDEV, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  ip = dip->type == T_FILE ? iget(ROOTDEV, inum) : 0;
+  brelse(bp);
+  return ip;
+}
+
+// Find the block at position pos in ip's scan order: the file's
+// own blocks, then those of each version from the newest.
+// Sets *vblock to the version node holding it (0 for the file),
+// *n to its index there and *b to the block (0 for a hole).
+// Returns -1 past the end.
+static int
+dedup_locate(struct inode *ip, uint pos, uint *vblock, uint *n, uint *b)
+{
+  struct version_node *v;
+  uint nfile, next;
+
+  nfile = (ip->size + BSIZE - 1) / BSIZE;
+  if(pos < nfile){
+    *vblock = 0;
+    *n = pos;
+    *b = bpeek(ip, pos);
+    return 0;
   }
-  
-  if(i == MAX_SNAPSHOTS){
-    release(&snapshot_lock);
-    return -1; // No space
+  pos -= nfile;
+
+  for(next = ip->version_head; next; ){
+    v = version_get(next);
+    if(pos < v->nblocks){
+      *vblock = next;
+      *n = pos;
+      *b = v->data_blocks[pos];
+      version_put(v);
+      return 0;
+    }
+    pos -= v->nblocks;
+    next = v->prev_version;
+    version_put(v);
   }
-  
-  // Initialize snapshot metadata
-  memmove(snapshots[i].name, name, 32);
-  snapshots[i].timestamp = get_timestamp();
-  snapshots[i].id = i + 1;
-  snapshots[i].valid = 1;
-  id = snapshots[i].id;
-  
-  release(&snapshot_lock);
-  
-  cprintf("Snapshot '%s' created successfully (ID: %d)\n", name, id);
-  return id;
+  return -1;
+}
+
+// Point the nth block of ip (vblock 0), or data_blocks[n] of
+// version node vblock, at an identical indexed block instead of
+// b, or else index b. Returns -1 if b was only indexed, else
+// the number of blocks freed.
+static int
+dedup_merge(struct inode *ip, uint vblock, uint n, uint b)
+{
+  char data[BSIZE];
+  struct buf *bp;
+  uint64 fp;
+  uint nb;
+  int r;
+
+  bp = bread(ip->dev, b);
+  memmove(data, bp->data, BSIZE);
+  brelse(bp);
+  fp = dedup_hash(data, BSIZE);
+
+  if(vblock == 0){
+    r = bdedup(ip, n, data, fp);
+  } else if((nb = bdupget(ip->dev, data, fp, b)) != 0){
+    bp = bread(ip->dev, vblock);
+    ((struct version_node*)bp->data)->data_blocks[n] = nb;
+    log_write(bp);
+    brelse(bp);
+    version_invalidate(vblock);
+    r = bdrop(ip->dev, b);
+  } else {
+    r = -1;
+  }
+
+  if(r < 0)
+    dedup_insert(fp, b);
+  return r;
 }
 
+// Deduplicate file inum and its versions against the dedup
+// index, whether or not inline dedup is on.
+// Returns the number of blocks freed, or -1 if inum is
+// out of range.
 int
-snapshot_restore(char *name)
+dedup_scan(uint inum)
 {
-  // Placeholder for restore logic
-  return -1;
+  struct inode *ip;
+  uint pos, vblock, n, b;
+  int r, freed, merged, seen, merges, done;
+
+  if(inum < 1 || inum >= sb.ninodes)
+    return -1;
+  if((ip = dedup_iget(inum)) == 0)
+    return 0;
+
+  freed = merged = 0;
+  pos = 0;
+  for(done = 0; !done; ){
+    begin_op();
+    ilock(ip);
+    for(seen = merges = 0; seen < DEDUP_SLICE && merges < DEDUP_MERGES; seen++){
+      if(dedup_locate(ip, pos++, &vblock, &n, &b) < 0){
+        done = 1;
+        break;
+      }
+      if(b && (r = dedup_merge(ip, vblock, n, b)) >= 0){
+        merges++;
+        freed += r;
+      }
+    }
+    iunlock(ip);
+    end_op();
+    merged += merges;
+  }
+
+  begin_op();
+  iput(ip);
+  end_op();
+
+  __sync_fetch_and_add(&gc_statistics.blocks_freed, freed);
+  __sync_fetch_and_add(&gc_statistics.blocks_merged, merged);
+  return freed;
 }
 
-// Deleted files tracking
-struct deleted_entry deleted_files[MAX_DELETED_FILES];
-struct spinlock deleted_lock;
+// ChronoFS: version retention.
+//
+// version_prune() walks a chain from the newest version and
+// unlinks the versions its policy does not keep. Unlinking only
+// drops the chain's reference; the gc thread frees nodes left
+// unreferenced. Nodes also held by a snapshot or the deleted-file
+// list cannot change, as that would rewrite their history too, so
+// the walk stops at the first one it would have to rewrite.
+
+// Does policy r keep a version created at ts, when n newer
+// versions have been kept, the oldest of them created at last?
+// Returns 1 to keep it, 0 to drop it, and -1 to drop it and
+// every older version.
+static int
+retain(struct retention *r, uint n, uint now, uint ts, uint last)
+{
+  uint age;
 
-void
-init_deleted_list(void)
+  if(r->max && n >= r->max)
+    return -1;
+  if(r->recent == 0 && r->hourly == 0 && r->daily == 0)
+    return 1;
+
+  // Ticks restart at boot, so versions from an earlier boot
+  // can look newer than they are; treat them as new.
+  age = ts <= now ? now - ts : 0;
+  if(age < r->recent)
+    return 1;
+  if(age < r->hourly)
+    return ts/TICKS_PER_HOUR != last/TICKS_PER_HOUR;
+  if(age < r->daily)
+    return ts/TICKS_PER_DAY != last/TICKS_PER_DAY;
+  return -1;
+}
+
+// Point version node keep at prev instead of at drop, and drop
+// the chain's reference to drop.
+static void
+version_unlink(uint keep, uint drop, uint prev)
 {
-  initlock(&deleted_lock, "deleted_files");
-  memset(deleted_files, 0, sizeof(deleted_files));
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, keep);
+  ((struct version_node*)bp->data)->prev_version = prev;
+  log_write(bp);
+  brelse(bp);
+  version_invalidate(keep);
+  version_release(drop);
 }
 
-// Add a file to the deleted list
-void
-add_deleted_file(char *name, uint inum, uint version_head)
+// Drop up to max versions of ip that policy r does not keep,
+// or that the file's own policy does not keep if r is 0.
+// Returns the number of versions dropped.
+// Caller must hold ip->lock and be inside a transaction.
+int
+version_prune(struct inode *ip, struct retention *r, int max)
 {
-  int i;
-  acquire(&deleted_lock);
-  
-  // Find empty slot
-  for(i = 0; i < MAX_DELETED_FILES; i++){
-    if(!deleted_files[i].valid){
-      memmove(deleted_files[i].name, name, DIRSIZ);
-      deleted_files[i].inum = inum;
-      deleted_files[i].version_head = version_head;
-      deleted_files[i].delete_time = get_timestamp();
-      deleted_files[i].valid = 1;
+  struct retention policy;
+  struct version_node *v;
+  uint keep, next, prev, n, now, ts, last;
+  int dropped, k;
+
+  if((v = version_get(ip->version_head)) == 0)
+    return 0;
+  if(r == 0){
+    if(v->has_policy)
+      policy = v->policy;
+    else
+      retention_get(&policy);
+    r = &policy;
+  }
+  keep = ip->version_head;
+  last = v->timestamp;
+  next = v->prev_version;
+  version_put(v);
+
+  now = get_timestamp();
+  dropped = 0;
+  for(n = 1; next && dropped < max && bref_get(keep) <= 1; ){
+    v = version_get(next);
+    ts = v->timestamp;
+    prev = v->prev_version;
+    version_put(v);
+
+    if((k = retain(r, n, now, ts, last)) > 0){
+      keep = next;
+      last = ts;
+      n++;
+    } else if(k < 0){
+      version_unlink(keep, next, 0);
+      dropped++;
       break;
+    } else {
+      // keep takes over the dropped node's reference to prev.
+      if(prev && bref_share(prev) < 0)
+        break;
+      version_unlink(keep, next, prev);
+      dropped++;
     }
+    next = prev;
   }
-  
-  release(&deleted_lock);
+
+  __sync_fetch_and_add(&gc_statistics.versions_pruned, dropped);
+  return dropped;
 }
 
-// Find a deleted file by name
-struct deleted_entry*
-find_deleted_file(char *name)
+// Give ip's versions their own retention policy, or make them
+// follow the global one again if r is 0. Newer versions inherit
+// it. Returns -1 if ip has no versions yet.
+// Caller must hold ip->lock and be inside a transaction.
+int
+version_setpolicy(struct inode *ip, struct retention *r)
 {
-  int i;
-  // Note: caller must hold deleted_lock if they want to modify
-  // For simple lookup, we just scan
-  
-  for(i = 0; i < MAX_DELETED_FILES; i++){
-    if(deleted_files[i].valid && strncmp(deleted_files[i].name, name, DIRSIZ) == 0){
-      return &deleted_files[i];
-    }
-  }
+  struct buf *bp;
+  struct version_node *vn;
+
+  if(ip->version_head == 0)
+    return -1;
+  bp = bread(ip->dev, ip->version_head);
+  vn = (struct version_node*)bp->data;
+  vn->has_policy = r != 0;
+  if(r)
+    vn->policy = *r;
+  else
+    memset(&vn->policy, 0, sizeof(vn->policy));
+  log_write(bp);
+  brelse(bp);
+  version_invalidate(ip->version_head);
   return 0;
 }
 
-// Recover a deleted file
-// Returns version_head on success, 0 on failure
-uint
-recover_deleted_file(char *name)
+// Apply policy r, or the file's own if r is 0, to file inum,
+// PRUNE_SLICE versions per transaction.
+// Returns the number of versions dropped, or -1 if inum is
+// out of range.
+int
+version_prune_inum(uint inum, struct retention *r)
 {
-  struct deleted_entry *de;
-  uint vhead = 0;
-  
-  acquire(&deleted_lock);
-  de = find_deleted_file(name);
-  if(de){
-    vhead = de->version_head;
-    de->valid = 0; // Remove from list
-  }
-  release(&deleted_lock);
-  
-  return vhead;
+  struct inode *ip;
+  int n, dropped;
+
+  if(inum < 1 || inum >= sb.ninodes)
+    return -1;
+  if((ip = dedup_iget(inum)) == 0)
+    return 0;
+
+  dropped = 0;
+  do {
+    begin_op();
+    ilock(ip);
+    n = version_prune(ip, r, PRUNE_SLICE);
+    iunlock(ip);
+    end_op();
+    dropped += n;
+  } while(n == PRUNE_SLICE);
+
+  begin_op();
+  iput(ip);
+  end_op();
+  return dropped;
 }
 
-// Free a version node and its resources
-void
-version_free(uint vblock)
+// Find the oldest version of ip whose space only ip holds,
+// for reclaiming under space pressure. Sets *keep to the node
+// linking to it, *drop to it and *ts to its timestamp.
+// Returns 0 if there is none.
+// Caller must hold ip->lock.
+static int
+version_oldest(struct inode *ip, uint *keep, uint *drop, uint *ts)
 {
-  struct version_node *vnode;
-  
-  if(vblock == 0)
-    return;
-  
-  vnode = version_get(vblock);
-  if(vnode == 0)
-    return;
-  
-  // Decrement reference counts for data blocks
-  for(uint i = 0; i < vnode->nblocks; i++){
-    if(vnode->data_blocks[i]){
-      uint refcount = bref_dec(vnode->data_blocks[i]);
-      // If refcount reaches 0, free the block
-      if(refcount == 0){
-        bfree(ROOTDEV, vnode->data_blocks[i]);
-      }
+  struct version_node *v;
+  uint k, next;
+  int found;
+
+  found = 0;
+  for(k = ip->version_head; k && bref_get(k) <= 1; k = next){
+    v = version_get(k);
+    next = v->prev_version;
+    version_put(v);
+    if(next && bref_get(next) <= 1){
+      v = version_get(next);
+      *keep = k;
+      *drop = next;
+      *ts = v->timestamp;
+      version_put(v);
+      found = 1;
     }
   }
-  
-  // Free the version node block itself
-  bfree(ROOTDEV, vblock);
+  return found;
 }
 
+// Drop the oldest version, across all files, that no snapshot
+// or deleted-file entry pins, so the gc thread can free it.
+// Returns 1 if it dropped one, 0 if there is none.
+// Caller must not be inside a transaction.
+int
+version_reclaim(void)
+{
+  struct inode *ip;
+  struct version_node *v;
+  uint inum, best, bestts, keep, drop, ts, prev;
+  int found;
+
+  best = bestts = 0;
+  for(inum = 1; inum < sb.ninodes; inum++){
+    if((ip = dedup_iget(inum)) == 0)
+      continue;
+    ilock(ip);
+    found = version_oldest(ip, &keep, &drop, &ts);
+    iunlock(ip);
+    begin_op();
+    iput(ip);
+    end_op();
+    if(found && (best == 0 || ts < bestts)){
+      best = inum;
+      bestts = ts;
+    }
+  }
+  if(best == 0 || (ip = dedup_iget(best)) == 0)
+    return 0;
+
+  // The chain may have changed since the scan; take whatever
+  // is oldest now.
+  begin_op();
+  ilock(ip);
+  found = version_oldest(ip, &keep, &drop, &ts);
+  if(found){
+    v = version_get(drop);
+    prev = v->prev_version;
+    version_put(v);
+    if(prev && bref_share(prev) < 0)
+      found = 0;
+    else
+      version_unlink(keep, drop, prev);
+  }
+  iunlock(ip);
+  end_op();
+  begin_op();
+  iput(ip);
+  end_op();
+
+  if(found)
+    __sync_fetch_and_add(&gc_statistics.versions_pruned, 1);
+  return found;
+}
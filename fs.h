@@ -6,19 +6,36 @@
 #define BSIZE 512  // block size
 
 // ChronoFS Configuration
-#define MAX_VERSIONS_PER_FILE 10    // Maximum versions to keep per file
+#define MAX_VERSIONS_PER_FILE 10    // Default cap on versions kept per file
 #define MAX_SNAPSHOTS 100           // Maximum number of snapshots
 #define SNAPSHOT_INODE_START 100    // Starting inode for snapshots
 #define SNAPSHOT_INODE_END 199      // Ending inode for snapshots
 #define JOURNAL_BLOCKS 100          // Number of blocks for journal
 #define JOURNAL_MAGIC 0x4A4F524E    // "JORN" magic number
-#define MAX_DELETED_TRACK 1000      // Max deleted files to track
+#define MAX_DELETED_TRACK 1000      // Max deleted files to track (on disk)
 
 // Version node structure (stored in data blocks)
 #define VNODE_DATA_BLOCKS 10
+
+// Version timestamps are in timer ticks, about 100 a second.
+#define TICKS_PER_HOUR (100*60*60)
+#define TICKS_PER_DAY  (24*TICKS_PER_HOUR)
+
+// Retention policy for a file's versions (see version_prune).
+// Versions younger than recent are all kept; then one per hour
+// is kept while younger than hourly, and one per day while
+// younger than daily; older ones are dropped. With all three 0
+// age is ignored. At most max versions are kept (0: no limit).
+// The newest version is always kept.
+struct retention {
+  uint max;
+  uint recent;
+  uint hourly;
+  uint daily;
+};
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
-//   free bit map | journal | data blocks]
+//   free bit map | refcounts | journal | data blocks]
 //
 // mkfs computes the super block and builds an initial file system. The
 // super block describes the disk layout:
@@ -32,6 +49,11 @@ struct superblock {
   uint bmapstart;    // Block number of first free map block
   uint journalstart; // Block number of first journal block (ChronoFS)
   uint njournalblocks; // Number of journal blocks (ChronoFS)
+  uint refstart;     // Block number of first refcount block
+  uint nrefblocks;   // Number of refcount blocks
+  uint gclist;       // First garbage version node (see gc.c)
+  uint delstart;     // Block number of first deleted-file registry block
+  uint ndelblocks;   // Number of deleted-file registry blocks
 };
 
 #define NDIRECT 10
@@ -64,12 +86,22 @@ struct dinode {
 // Block containing inode i
 #define IBLOCK(i, sb)     ((i) / IPB + sb.inodestart)
 
+// Blocks balloc() holds back so that snapshot_cow() can
+// still save an inode block when the disk is otherwise full.
+#define BRESERVE(sb) ((sb).ninodes/IPB + 1)
+
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) (b/BPB + sb.bmapstart)
 
+// Reference counts per block; 0 means one implicit owner.
+#define RPB           (BSIZE / sizeof(ushort))
+
+// Block of refcount region containing the count for block b
+#define RBLOCK(b, sb) ((b)/RPB + sb.refstart)
+
 // Directory is a file containing a sequence of dirent structures.
 #define DIRSIZ 14
 
@@ -88,6 +120,9 @@ struct version_node {
   char description[32];     // Optional description
   uint checksum;            // Simple integrity check
   uint snapshot_id;         // ID of snapshot this version belongs to (0 if none)
+  uint gc_next;             // Next node on the garbage list (see gc.c)
+  uint has_policy;          // policy overrides the global one
+  struct retention policy;  // Per-file retention, inherited by newer versions
 };
 
 // Snapshot metadata structure (stored in snapshot inodes)
@@ -103,6 +138,17 @@ struct snapshot_metadata {
   char reserved[32];        // Reserved for future use
 };
 
+// Snapshot block (first data block of a snapshot inode).
+// itable[i] is a frozen copy of inode block i taken the first
+// time that block changed while this was the newest snapshot.
+// 0 means the block had not changed before the next newer
+// snapshot was taken (or, for the newest, has not changed yet).
+#define SNAPSHOT_NIBLOCKS 64
+struct snapshot_block {
+  struct snapshot_metadata meta;
+  uint itable[SNAPSHOT_NIBLOCKS];
+};
+
 // Journal header (at start of journal region)
 struct journal_header {
   uint magic;               // JOURNAL_MAGIC
@@ -125,25 +171,36 @@ struct block_refcount {
   uint refcount;            // Reference count
   uint checksum;            // For deduplication
   uint valid;               // Is this entry valid?
+  uint dirty;               // Changed in the running transaction?
+  uint dead;                // Freed in the running transaction?
 };
 
 // Deduplication hash table entry
 struct dedup_entry {
-  uint checksum;            // Block content checksum
-  uint block_num;           // Block number with this content
-  uint refcount;            // How many references
-  uint valid;               // Is this entry valid?
+  uint64 fp;                // Block content fingerprint
+  uint block_num;           // Block with this content (0 = empty)
+  uint hits;                // Recent lookups it answered
 };
 
-// Deleted file tracking (for recovery)
+// Deleted file tracking (for recovery).
+// The registry is a ring of these on disk (see recovery.c).
+// DELPATH makes an entry 128 bytes, so a whole number fit in a
+// block.
+#define DELPATH 112
 struct deleted_entry {
-  char name[DIRSIZ];        // Original filename
-  uint inum;                // Inode number  
-  uint version_head;        // Head of version chain
+  char path[DELPATH];       // Full path when deleted
+  uint inum;                // Inode number
+  uint version_head;        // Head of version chain (0 = unused)
   uint delete_time;         // When it was deleted
-  int valid;                // Is this entry valid?
+  uint seq;                 // Deletion order
 };
 
+// Registry entries per block
+#define DPB           (BSIZE / sizeof(struct deleted_entry))
+
+// Block of the registry holding entry i
+#define DBLOCK(i, sb) ((i) / DPB + sb.delstart)
+
 // Version information (for user queries)
 struct version_info {
   uint version_num;         // Version number (0 = oldest)
@@ -153,11 +210,32 @@ struct version_info {
   char description[32];     // Optional description
 };
 
+// Changed block range (for snapshot and version diffs)
+#define DIFF_ADDED    1     // File exists only on the second side
+#define DIFF_REMOVED  2     // File exists only on the first side
+#define DIFF_MODIFIED 3     // File exists on both sides
+
+struct diff_entry {
+  uint inum;                // Inode number
+  uint type;                // DIFF_ADDED, DIFF_REMOVED or DIFF_MODIFIED
+  uint size_a;              // File size on the first side
+  uint size_b;              // File size on the second side
+  uint start;               // First changed file block
+  uint nblocks;             // Changed blocks from start (0 = metadata only)
+};
+
+// Inline deduplication counters (for the dedup system call)
+struct dedup_stats {
+  uint lookups;             // Full-block writes checked against the index
+  uint hits;                // Writes that shared an identical block
+  uint mismatches;          // Checksum matches whose bytes differed
+  uint inserts;             // Blocks added to the index
+  uint evictions;           // Entries dropped from full buckets
+};
+
 // Recovery entry (for listing recoverable files)
 // struct deleted_entry is already defined above
 
-#define MAX_DELETED_FILES 32
-
 struct recovery_entry {
   char path[128];           // File path
   uint deletion_time;       // When deleted
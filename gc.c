@@ -2,266 +2,918 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "rwlock.h"
 #include "fs.h"
+#include "buf.h"
 #include "file.h"
 #include "gc.h"
 
-// Block reference counting table
+// Block reference counts.
+// The counts live on disk in the refcount region laid out by
+// mkfs (see RBLOCK), one ushort per block, and change only
+// through the log, so they survive a reboot and a crash needs
+// nothing beyond log recovery. A count of 0 means the block is
+// not tracked: it has one implicit owner, or is free.
+//
+// Counts are read into a cache on first use: a hash table keyed
+// by block number, split into BREF_STRIPES independent stripes,
+// each with its own lock and its own open-addressing (linear
+// probing) array. Consecutive blocks land in different stripes,
+// and a block's home slot within its stripe is derived from the
+// rest of its number, so lookups normally hit on the first
+// probe. Untracked blocks are cached too, since they are the
+// common case.
+//
+// Updates change only the cached count and mark it dirty; the
+// running transaction's dirty counts are written to the
+// refcount region in one pass by bref_commit(), called from the
+// log's commit(). Many updates to the same count, or to counts
+// in the same refcount block, cost one logged block write.
+// Clean entries may be evicted when a stripe fills.
 #define MAX_REFCOUNT_ENTRIES 10000
-struct {
+#define BREF_STRIPES 8
+#define BREF_SLOTS (MAX_REFCOUNT_ENTRIES / BREF_STRIPES)
+#define BREF_MAX 0xFFFF
+
+struct brefstripe {
   struct spinlock lock;
-  struct block_refcount entries[MAX_REFCOUNT_ENTRIES];
+  struct block_refcount entries[BREF_SLOTS];
+  uint ndirty;
+  uint dirty[BREF_SLOTS];   // blocks whose count is dirty
+};
+
+struct {
+  struct brefstripe stripe[BREF_STRIPES];
 } refcount_table;
 
-// Deduplication hash table
-#define DEDUP_TABLE_SIZE 1000
+// Deduplication index.
+// A hash table of 64-bit content fingerprints, sized at boot to
+// the number of data blocks and built from kalloc()ed pages.
+// A fingerprint selects one bucket of DEDUP_SLOTS entries; a
+// full bucket evicts its least used entry, so the index stays
+// useful, if lossy, on a file system of any size, and its memory
+// is bounded by DEDUP_MAXPAGES. Entries are only hints: callers
+// check that a block is still live and byte-identical before
+// sharing it, and remove entries that turn out stale.
+// Lookups take the lock only for reading, so their hit counts
+// are updated racily; they only guide eviction.
+//
+// A block is live from being indexed until it is freed, one bit
+// per block in live[]. A freed block may be reused for metadata
+// that is written in place (an indirect block, a version node),
+// so an entry for a block that is no longer live is never
+// trusted, whatever its bytes. The bits are set and cleared
+// atomically, without the lock.
+#define DEDUP_SLOTS 8
+#define DEDUP_MAXPAGES 1024
+#define DEDUP_LIVEPAGES 32
+#define DEDUP_BITSPP (PGSIZE*8)
+
+struct dedup_bucket {
+  struct dedup_entry slot[DEDUP_SLOTS];
+};
+
+#define DEDUP_BPP (PGSIZE / sizeof(struct dedup_bucket))
+
 struct {
-  struct spinlock lock;
-  struct dedup_entry entries[DEDUP_TABLE_SIZE];
+  struct rwlock lock;
+  uint nbuckets;
+  struct dedup_bucket *page[DEDUP_MAXPAGES];
+  uint nlive;                   // blocks covered by live[]
+  uchar *live[DEDUP_LIVEPAGES];
 } dedup_table;
 
-// GC statistics
+// GC statistics. The gc thread and foreground reclaims and
+// scans update them at once, so counts are added atomically.
 struct gc_stats gc_statistics;
 
+// Inline deduplication on the writei() path; off by default.
+int dedup_enabled;
+// Counters the index updates itself change under
+// dedup_table.lock; the others are added to atomically.
+struct dedup_stats dedup_statistics;
+
+extern struct superblock sb;
+
 // Initialize reference counting system
 void
 bref_init(void)
 {
-  initlock(&refcount_table.lock, "refcount");
-  
-  acquire(&refcount_table.lock);
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    refcount_table.entries[i].valid = 0;
-    refcount_table.entries[i].refcount = 0;
+  struct brefstripe *st;
+
+  for(st = refcount_table.stripe; st < &refcount_table.stripe[BREF_STRIPES]; st++){
+    initlock(&st->lock, "refcount");
+    memset(st->entries, 0, sizeof(st->entries));
+    st->ndirty = 0;
   }
-  release(&refcount_table.lock);
 }
 
-// Find or create refcount entry for a block
+static struct brefstripe*
+bref_stripe(uint block_num)
+{
+  return &refcount_table.stripe[block_num % BREF_STRIPES];
+}
+
+// Home slot of block_num within its stripe.
+static uint
+bref_home(uint block_num)
+{
+  return (block_num / BREF_STRIPES) % BREF_SLOTS;
+}
+
+// Find the cached entry for a block. Caller must hold st->lock.
 static struct block_refcount*
-bref_find_or_create(uint block_num)
+bref_lookup(struct brefstripe *st, uint block_num)
 {
-  struct block_refcount *entry = 0;
-  
-  // First try to find existing entry
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    if(refcount_table.entries[i].valid && 
-       refcount_table.entries[i].block_num == block_num){
-      return &refcount_table.entries[i];
-    }
+  uint i, n;
+
+  i = bref_home(block_num);
+  for(n = 0; n < BREF_SLOTS && st->entries[i].valid; n++){
+    if(st->entries[i].block_num == block_num)
+      return &st->entries[i];
+    i = (i + 1) % BREF_SLOTS;
   }
-  
-  // Create new entry
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    if(!refcount_table.entries[i].valid){
-      entry = &refcount_table.entries[i];
+  return 0;
+}
+
+// Find or create the cached entry for a block.
+// Caller must hold st->lock.
+static struct block_refcount*
+bref_find_or_create(struct brefstripe *st, uint block_num)
+{
+  struct block_refcount *entry;
+  uint i, n;
+
+  i = bref_home(block_num);
+  for(n = 0; n < BREF_SLOTS; n++){
+    entry = &st->entries[i];
+    if(!entry->valid){
+      // Probe sequences never skip an empty slot,
+      // so block_num is not further along.
       entry->valid = 1;
       entry->block_num = block_num;
       entry->refcount = 0;
       entry->checksum = 0;
+      entry->dirty = 0;
+      entry->dead = 0;
       return entry;
     }
+    if(entry->block_num == block_num)
+      return entry;
+    i = (i + 1) % BREF_SLOTS;
   }
   
-  return 0; // Table full
+  return 0; // Stripe full
 }
 
-// Increment block reference count
-int
-bref_inc(uint block_num)
+// Remove entry and shift later members of its probe run back,
+// so lookups still find them without tombstones.
+// Caller must hold st->lock.
+static void
+bref_remove(struct brefstripe *st, struct block_refcount *entry)
 {
-  acquire(&refcount_table.lock);
-  
-  struct block_refcount *entry = bref_find_or_create(block_num);
-  if(entry == 0){
-    release(&refcount_table.lock);
-    return -1; // Table full
+  uint i, j, k;
+
+  i = entry - st->entries;
+  st->entries[i].valid = 0;
+  for(j = (i + 1) % BREF_SLOTS; st->entries[j].valid; j = (j + 1) % BREF_SLOTS){
+    k = bref_home(st->entries[j].block_num);
+    // Leave j alone if its home lies cyclically in (i, j].
+    if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    st->entries[i] = st->entries[j];
+    st->entries[j].valid = 0;
+    i = j;
   }
-  
-  entry->refcount++;
-  release(&refcount_table.lock);
-  return entry->refcount;
 }
 
-// Decrement block reference count
-int
-bref_dec(uint block_num)
+// Cache a count just read from disk, evicting a clean entry
+// if the stripe is full. Caller must hold st->lock.
+static void
+bref_insert(struct brefstripe *st, uint block_num, uint count)
 {
-  acquire(&refcount_table.lock);
-  
-  struct block_refcount *entry = 0;
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    if(refcount_table.entries[i].valid && 
-       refcount_table.entries[i].block_num == block_num){
-      entry = &refcount_table.entries[i];
-      break;
-    }
-  }
-  
+  struct block_refcount *entry;
+  uint i, n;
+
+  entry = bref_find_or_create(st, block_num);
   if(entry == 0){
-    release(&refcount_table.lock);
-    return 0; // Not found
+    i = bref_home(block_num);
+    for(n = 0; n < BREF_SLOTS && st->entries[i].dirty; n++)
+      i = (i + 1) % BREF_SLOTS;
+    if(n == BREF_SLOTS)
+      panic("bref: too many dirty counts");
+    bref_remove(st, &st->entries[i]);
+    entry = bref_find_or_create(st, block_num);
   }
-  
-  if(entry->refcount > 0)
-    entry->refcount--;
-  
-  uint count = entry->refcount;
-  
-  // If refcount reaches 0, mark entry as invalid
-  if(entry->refcount == 0){
-    entry->valid = 0;
+  entry->refcount = count;
+  entry->dirty = 0;
+}
+
+// Return the locked buffer holding block_num's on-disk count.
+// Holding it keeps bref_commit() from changing the count while
+// it is being loaded into the cache.
+static struct buf*
+bref_buf(uint block_num)
+{
+  if(block_num >= sb.size)
+    panic("bref: block out of range");
+  return bread(ROOTDEV, RBLOCK(block_num, sb));
+}
+
+// Return the cache entry for block_num with st->lock held,
+// loading the count from disk first if it is not cached.
+static struct block_refcount*
+bref_entry(struct brefstripe *st, uint block_num)
+{
+  struct block_refcount *entry;
+  struct buf *bp;
+
+  acquire(&st->lock);
+  while((entry = bref_lookup(st, block_num)) == 0){
+    release(&st->lock);
+    bp = bref_buf(block_num);
+    acquire(&st->lock);
+    if(bref_lookup(st, block_num) == 0)
+      bref_insert(st, block_num, ((ushort*)bp->data)[block_num % RPB]);
+    release(&st->lock);
+    brelse(bp);
+    acquire(&st->lock);
+  }
+  return entry;
+}
+
+// Set entry's count and queue it for bref_commit().
+// Caller must hold st->lock. Returns count.
+static int
+bref_update(struct brefstripe *st, struct block_refcount *entry, uint count)
+{
+  entry->refcount = count;
+  if(!entry->dirty){
+    entry->dirty = 1;
+    st->dirty[st->ndirty++] = entry->block_num;
   }
-  
-  release(&refcount_table.lock);
   return count;
 }
 
-// Check if a block is tracked in the refcount table
+// Increment block reference count.
+// Like the other updates below, must be called inside a
+// transaction; the new count reaches disk when it commits.
 int
-bref_is_tracked(uint block_num)
+bref_inc(uint block_num)
 {
-  acquire(&refcount_table.lock);
-  
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    if(refcount_table.entries[i].valid && 
-       refcount_table.entries[i].block_num == block_num){
-      release(&refcount_table.lock);
-      return 1; // Found
-    }
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+  int r;
+
+  entry = bref_entry(st, block_num);
+  if(entry->refcount == BREF_MAX)
+    r = -1; // Count would overflow
+  else
+    r = bref_update(st, entry, entry->refcount + 1);
+  release(&st->lock);
+  return r;
+}
+
+// Add a reference to a block that already has an owner.
+// A block that is not tracked has exactly one implicit
+// owner (the inode it was allocated for), so sharing it
+// starts its count at 2.
+int
+bref_share(uint block_num)
+{
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+  int r;
+
+  entry = bref_entry(st, block_num);
+  if(entry->refcount == BREF_MAX)
+    r = -1; // Count would overflow
+  else
+    r = bref_update(st, entry, entry->refcount ? entry->refcount + 1 : 2);
+  release(&st->lock);
+  return r;
+}
+
+// Like bref_share(), but fails if the block was freed in the
+// running transaction (see bref_drop()). For sharing a block
+// found through the dedup index, which may be freed meanwhile.
+int
+bref_share_live(uint block_num)
+{
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+  int r;
+
+  entry = bref_entry(st, block_num);
+  if(entry->dead || entry->refcount == BREF_MAX)
+    r = -1;
+  else
+    r = bref_update(st, entry, entry->refcount ? entry->refcount + 1 : 2);
+  release(&st->lock);
+  return r;
+}
+
+// Drop the caller's reference to a block. Returns the number
+// of references left; 0 means the caller held the last one and
+// must free the block. The block then stays dead to
+// bref_share_live() until the transaction commits, which
+// covers any dedup lookup that could still return it.
+int
+bref_drop(uint block_num)
+{
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+  int r;
+
+  entry = bref_entry(st, block_num);
+  if(entry->refcount > 1){
+    r = bref_update(st, entry, entry->refcount - 1);
+  } else {
+    // Marks the entry dirty too, so bref_commit()
+    // clears dead and it is not evicted before then.
+    r = bref_update(st, entry, 0);
+    entry->dead = 1;
   }
-  
-  release(&refcount_table.lock);
-  return 0; // Not found
+  release(&st->lock);
+  return r;
 }
 
+// Decrement block reference count
+int
+bref_dec(uint block_num)
+{
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+  int r;
+
+  entry = bref_entry(st, block_num);
+  if(entry->refcount == 0)
+    r = 0; // Not tracked
+  else
+    r = bref_update(st, entry, entry->refcount - 1);
+  release(&st->lock);
+  return r;
+}
+
+// Set block reference count
+void
+bref_set(uint block_num, uint count)
+{
+  struct brefstripe *st = bref_stripe(block_num);
+  struct block_refcount *entry;
+
+  if(count > BREF_MAX)
+    panic("bref_set: count too large");
+  entry = bref_entry(st, block_num);
+  bref_update(st, entry, count);
+  release(&st->lock);
+}
 
-// Get block reference count
+// Get block reference count; 0 if not tracked.
 uint
 bref_get(uint block_num)
 {
-  acquire(&refcount_table.lock);
-  
-  for(int i = 0; i < MAX_REFCOUNT_ENTRIES; i++){
-    if(refcount_table.entries[i].valid && 
-       refcount_table.entries[i].block_num == block_num){
-      uint count = refcount_table.entries[i].refcount;
-      release(&refcount_table.lock);
-      return count;
+  struct brefstripe *st = bref_stripe(block_num);
+  uint count;
+
+  count = bref_entry(st, block_num)->refcount;
+  release(&st->lock);
+  return count;
+}
+
+// Check if a block is tracked in the refcount table
+int
+bref_is_tracked(uint block_num)
+{
+  return bref_get(block_num) > 0;
+}
+
+// Write the running transaction's dirty counts to the refcount
+// region. Called by the log's commit(), when no FS system call
+// is running, so nothing else makes counts dirty meanwhile.
+void
+bref_commit(void)
+{
+  struct brefstripe *st;
+  struct block_refcount *entry;
+  struct buf *bp;
+  uint i, b;
+
+  bp = 0;
+  for(st = refcount_table.stripe; st < &refcount_table.stripe[BREF_STRIPES]; st++){
+    for(i = 0; i < st->ndirty; i++){
+      b = st->dirty[i];
+      if(bp == 0 || bp->blockno != RBLOCK(b, sb)){
+        if(bp){
+          log_write(bp);
+          brelse(bp);
+        }
+        bp = bref_buf(b);
+      }
+      // Dirty entries are never evicted, but readers
+      // may move them within the probe run.
+      acquire(&st->lock);
+      entry = bref_lookup(st, b);
+      ((ushort*)bp->data)[b % RPB] = entry->refcount;
+      entry->dirty = 0;
+      entry->dead = 0;
+      release(&st->lock);
     }
+    st->ndirty = 0;
+  }
+  if(bp){
+    log_write(bp);
+    brelse(bp);
   }
-  
-  release(&refcount_table.lock);
-  return 0; // Not found or refcount is 0
 }
 
-// Initialize deduplication system
+// Initialize deduplication system.
+// Called after the superblock has been read.
 void
 dedup_init(void)
 {
-  initlock(&dedup_table.lock, "dedup");
-  
-  acquire(&dedup_table.lock);
-  for(int i = 0; i < DEDUP_TABLE_SIZE; i++){
-    dedup_table.entries[i].valid = 0;
-    dedup_table.entries[i].refcount = 0;
+  uint i, npages;
+
+  initrwlock(&dedup_table.lock, "dedup");
+
+  // About one entry per data block.
+  npages = sb.nblocks / (DEDUP_BPP * DEDUP_SLOTS) + 1;
+  if(npages > DEDUP_MAXPAGES)
+    npages = DEDUP_MAXPAGES;
+  for(i = 0; i < npages; i++){
+    if((dedup_table.page[i] = (struct dedup_bucket*)kalloc_zeroed()) == 0)
+      break; // Make do with a smaller index
+  }
+  dedup_table.nbuckets = i * DEDUP_BPP;
+
+  npages = sb.size / DEDUP_BITSPP + 1;
+  if(npages > DEDUP_LIVEPAGES)
+    npages = DEDUP_LIVEPAGES;
+  for(i = 0; i < npages; i++){
+    if((dedup_table.live[i] = (uchar*)kalloc_zeroed()) == 0)
+      break; // Blocks past the bitmap are never indexed
   }
-  release(&dedup_table.lock);
+  dedup_table.nlive = i * DEDUP_BITSPP;
 }
 
-// Simple checksum function (djb2 hash)
-uint
+// Byte of live[] holding block b's bit, or 0 if b has none.
+static uchar*
+dedup_livebyte(uint b)
+{
+  if(b >= dedup_table.nlive)
+    return 0;
+  return &dedup_table.live[b / DEDUP_BITSPP][(b % DEDUP_BITSPP) / 8];
+}
+
+// Has block b been indexed since it was last allocated?
+int
+dedup_live(uint b)
+{
+  uchar *p;
+
+  if((p = dedup_livebyte(b)) == 0)
+    return 0;
+  return (*(volatile uchar*)p & (1 << (b % 8))) != 0;
+}
+
+// Block b is being freed: no index entry for it may be used
+// again, even if b is reused with the same bytes.
+void
+dedup_forget(uint b)
+{
+  uchar *p;
+
+  if((p = dedup_livebyte(b)) != 0)
+    __sync_fetch_and_and(p, ~(1 << (b % 8)));
+}
+
+// 64-bit content fingerprint: FNV-1a over 32-bit words,
+// finished with the MurmurHash3 mixer so that every input
+// bit reaches the bits used to pick a bucket.
+uint64
 dedup_hash(char *data, uint len)
 {
-  uint hash = 5381;
-  
-  for(uint i = 0; i < len; i++){
-    hash = ((hash << 5) + hash) + data[i]; // hash * 33 + c
-  }
-  
-  return hash;
+  uint64 h = 0xcbf29ce484222325ULL;
+  uint i;
+
+  for(i = 0; i + 4 <= len; i += 4)
+    h = (h ^ *(uint*)(data + i)) * 0x100000001b3ULL;
+  for(; i < len; i++)
+    h = (h ^ (uchar)data[i]) * 0x100000001b3ULL;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Bucket for fingerprint fp, or 0 if there is no index.
+// Caller must hold dedup_table.lock.
+static struct dedup_bucket*
+dedup_bucket(uint64 fp)
+{
+  uint i;
+
+  if(dedup_table.nbuckets == 0)
+    return 0;
+  i = ((uint)fp ^ (uint)(fp >> 32)) % dedup_table.nbuckets;
+  return &dedup_table.page[i / DEDUP_BPP][i % DEDUP_BPP];
 }
 
-// Find block with matching checksum
+// Find a block that has had fingerprint fp.
+// Returns 0 if none is known.
 uint
-dedup_find(uint checksum)
+dedup_find(uint64 fp)
 {
-  acquire(&dedup_table.lock);
-  
-  for(int i = 0; i < DEDUP_TABLE_SIZE; i++){
-    if(dedup_table.entries[i].valid && 
-       dedup_table.entries[i].checksum == checksum &&
-       dedup_table.entries[i].refcount > 0){
-      uint block = dedup_table.entries[i].block_num;
-      release(&dedup_table.lock);
-      return block;
+  struct dedup_bucket *bk;
+  struct dedup_entry *e;
+  uint block = 0;
+
+  acquireread(&dedup_table.lock);
+  if((bk = dedup_bucket(fp)) != 0){
+    for(e = bk->slot; e < &bk->slot[DEDUP_SLOTS]; e++){
+      if(e->block_num && e->fp == fp){
+        if(e->hits < 0xFFFF)
+          e->hits++;
+        block = e->block_num;
+        break;
+      }
     }
   }
-  
-  release(&dedup_table.lock);
-  return 0; // Not found
+  releaseread(&dedup_table.lock);
+  return block;
 }
 
-// Insert block into dedup table
+// Record that block_num, a file data block, holds content
+// with fingerprint fp.
+// Returns 0 on success, -1 if there is no index.
 int
-dedup_insert(uint checksum, uint block_num)
+dedup_insert(uint64 fp, uint block_num)
 {
-  acquire(&dedup_table.lock);
-  
-  // Check if already exists
-  for(int i = 0; i < DEDUP_TABLE_SIZE; i++){
-    if(dedup_table.entries[i].valid && 
-       dedup_table.entries[i].block_num == block_num){
-      dedup_table.entries[i].checksum = checksum;
-      dedup_table.entries[i].refcount++;
-      release(&dedup_table.lock);
-      return 0;
-    }
+  struct dedup_bucket *bk;
+  struct dedup_entry *e, *victim;
+  uchar *p;
+
+  if((p = dedup_livebyte(block_num)) == 0)
+    return -1;
+
+  acquirewrite(&dedup_table.lock);
+  if((bk = dedup_bucket(fp)) == 0){
+    releasewrite(&dedup_table.lock);
+    return -1;
   }
-  
-  // Find empty slot
-  for(int i = 0; i < DEDUP_TABLE_SIZE; i++){
-    if(!dedup_table.entries[i].valid){
-      dedup_table.entries[i].valid = 1;
-      dedup_table.entries[i].checksum = checksum;
-      dedup_table.entries[i].block_num = block_num;
-      dedup_table.entries[i].refcount = 1;
-      release(&dedup_table.lock);
-      return 0;
+
+  victim = 0;
+  for(e = bk->slot; e < &bk->slot[DEDUP_SLOTS]; e++){
+    if(e->block_num && e->fp == fp){
+      if(dedup_live(e->block_num)){
+        // Already have a block with this content.
+        releasewrite(&dedup_table.lock);
+        return 0;
+      }
+      // That block has been freed; index this one instead.
+      e->block_num = 0;
+      victim = e;
+      break;
     }
+    if(victim == 0 || e->block_num == 0 ||
+       (victim->block_num && e->hits < victim->hits))
+      victim = e;
   }
-  
-  release(&dedup_table.lock);
-  return -1; // Table full
+
+  if(victim->block_num){
+    // Bucket full: evict the least used entry, and age the
+    // rest so that old popularity does not last forever.
+    dedup_statistics.evictions++;
+    for(e = bk->slot; e < &bk->slot[DEDUP_SLOTS]; e++)
+      e->hits /= 2;
+  }
+  __sync_fetch_and_or(p, 1 << (block_num % 8));
+  victim->fp = fp;
+  victim->block_num = block_num;
+  victim->hits = 0;
+  dedup_statistics.inserts++;
+  releasewrite(&dedup_table.lock);
+  return 0;
 }
 
-// Remove block from dedup table
+// Forget that block_num had fingerprint fp, because it
+// has been freed or rewritten since.
 int
-dedup_remove(uint block_num)
+dedup_remove(uint64 fp, uint block_num)
 {
-  acquire(&dedup_table.lock);
-  
-  for(int i = 0; i < DEDUP_TABLE_SIZE; i++){
-    if(dedup_table.entries[i].valid && 
-       dedup_table.entries[i].block_num == block_num){
-      if(dedup_table.entries[i].refcount > 0)
-        dedup_table.entries[i].refcount--;
-      
-      if(dedup_table.entries[i].refcount == 0){
-        dedup_table.entries[i].valid = 0;
+  struct dedup_bucket *bk;
+  struct dedup_entry *e;
+
+  acquirewrite(&dedup_table.lock);
+  if((bk = dedup_bucket(fp)) != 0){
+    for(e = bk->slot; e < &bk->slot[DEDUP_SLOTS]; e++){
+      if(e->block_num == block_num && e->fp == fp){
+        e->block_num = 0;
+        releasewrite(&dedup_table.lock);
+        return 0;
       }
-      release(&dedup_table.lock);
-      return 0;
     }
   }
-  
-  release(&dedup_table.lock);
+  releasewrite(&dedup_table.lock);
   return -1; // Not found
 }
 
-// Initialize garbage collection
+// Turn inline dedup on (enable > 0) or off (enable == 0),
+// or leave it alone (enable < 0), and copy the counters to st
+// if it is not null. Returns the previous setting.
+int
+dedup_config(int enable, struct dedup_stats *st)
+{
+  int old;
+
+  acquirewrite(&dedup_table.lock);
+  old = dedup_enabled;
+  if(enable >= 0)
+    dedup_enabled = enable > 0;
+  if(st)
+    *st = dedup_statistics;
+  releasewrite(&dedup_table.lock);
+  return old;
+}
+
+//PAGEBREAK!
+// Garbage collector.
+//
+// A version node becomes garbage when the last reference to it
+// is dropped (version_release()): the inode or deleted-file entry
+// naming it went away, or a rollback replaced the chain. Garbage
+// nodes are pushed on a list threaded through their gc_next
+// fields, with its head in the superblock, in the transaction
+// that dropped them, so a crash never loses one.
+//
+// The gc thread frees them incrementally. Each gc_run() slice is
+// its own small transaction that frees at most GC_SLICE blocks,
+// so foreground begin_op() callers never wait behind a long
+// collection: gc_collect_blocks() drops the data blocks of the
+// node at the head of the list, and gc_collect_versions() then
+// frees the node itself and drops its reference to the previous
+// version, which may make that one garbage in turn. The thread
+// runs when balloc() sees free space fall below the watermark.
+#define GC_SLICE (MAXOPBLOCKS-2)
+
+struct {
+  struct sleeplock lock;    // protects sb.gclist and the list
+  struct spinlock wlock;    // protects wanted and policy
+  int wanted;               // balloc() asked for a collection
+  struct retention policy;  // for files without their own
+} gc;
+
+// Write sb.gclist through to the on-disk superblock.
+// Caller must hold gc.lock and be inside a transaction.
+static void
+gc_sbwrite(void)
+{
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, 1);
+  ((struct superblock*)bp->data)->gclist = sb.gclist;
+  log_write(bp);
+  brelse(bp);
+}
+
+// Push garbage version node vblock on the list.
+// Caller must hold gc.lock and be inside a transaction.
+static void
+gc_push_locked(uint vblock)
+{
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, vblock);
+  ((struct version_node*)bp->data)->gc_next = sb.gclist;
+  log_write(bp);
+  brelse(bp);
+  sb.gclist = vblock;
+  gc_sbwrite();
+}
+
+// Queue version node vblock, whose last reference the caller
+// has just dropped, to be freed by the gc thread.
+// Caller must be inside a transaction.
+void
+gc_push(uint vblock)
+{
+  acquiresleep(&gc.lock);
+  gc_push_locked(vblock);
+  releasesleep(&gc.lock);
+}
+
+// Drop up to GC_SLICE data blocks of the garbage version node
+// at the head of the list, in one transaction.
+// Returns the number of blocks freed, or -1 if that node has
+// no data blocks left or the list is empty.
+int
+gc_collect_blocks(void)
+{
+  struct buf *bp;
+  struct version_node *vn;
+  int i, n, freed;
+
+  n = freed = 0;
+  begin_op();
+  acquiresleep(&gc.lock);
+  if(sb.gclist){
+    bp = bread(ROOTDEV, sb.gclist);
+    vn = (struct version_node*)bp->data;
+    for(i = 0; i < VNODE_DATA_BLOCKS && n < GC_SLICE; i++){
+      if(vn->data_blocks[i] == 0)
+        continue;
+      freed += bdrop(ROOTDEV, vn->data_blocks[i]);
+      vn->data_blocks[i] = 0;
+      n++;
+    }
+    if(n > 0)
+      log_write(bp);
+    brelse(bp);
+  }
+  releasesleep(&gc.lock);
+  end_op();
+
+  __sync_fetch_and_add(&gc_statistics.blocks_freed, freed);
+  return n > 0 ? freed : -1;
+}
+
+// Free the garbage version node at the head of the list, once
+// gc_collect_blocks() has emptied it, in one transaction, and
+// drop its reference to the previous version.
+// Returns 1 if it made progress, 0 if the list is empty.
+int
+gc_collect_versions(void)
+{
+  struct buf *bp;
+  struct version_node *vn;
+  uint v, next, prev;
+  int i, busy;
+
+  begin_op();
+  acquiresleep(&gc.lock);
+  if((v = sb.gclist) == 0){
+    releasesleep(&gc.lock);
+    end_op();
+    return 0;
+  }
+
+  bp = bread(ROOTDEV, v);
+  vn = (struct version_node*)bp->data;
+  busy = 0;
+  for(i = 0; i < VNODE_DATA_BLOCKS; i++)
+    if(vn->data_blocks[i])
+      busy = 1;
+  next = vn->gc_next;
+  prev = vn->prev_version;
+  brelse(bp);
+
+  if(!busy){
+    sb.gclist = next;
+    gc_sbwrite();
+    version_invalidate(v);
+    bfree(ROOTDEV, v);
+    if(prev && bref_drop(prev) == 0)
+      gc_push_locked(prev);
+    __sync_fetch_and_add(&gc_statistics.blocks_freed, 1);
+    __sync_fetch_and_add(&gc_statistics.versions_freed, 1);
+  }
+  releasesleep(&gc.lock);
+  end_op();
+  return 1;
+}
+
+// Do one bounded slice of garbage collection.
+// Returns 0 once there is nothing left to collect.
+int
+gc_run(void)
+{
+  __sync_fetch_and_add(&gc_statistics.total_runs, 1);
+  gc_statistics.last_run_time = get_timestamp();
+
+  if(gc_collect_blocks() >= 0)
+    return 1;
+  return gc_collect_versions();
+}
+
+// Ask the gc thread for a collection.
+void
+gc_wakeup(void)
+{
+  acquire(&gc.wlock);
+  gc.wanted = 1;
+  wakeup(&gc);
+  release(&gc.wlock);
+}
+
+// Copy the global retention policy into *r.
+void
+retention_get(struct retention *r)
+{
+  acquire(&gc.wlock);
+  *r = gc.policy;
+  release(&gc.wlock);
+}
+
+// Set the global retention policy and have the gc thread
+// apply it.
+void
+retention_set(struct retention *r)
+{
+  acquire(&gc.wlock);
+  gc.policy = *r;
+  release(&gc.wlock);
+  gc_wakeup();
+}
+
+// Apply retention policy r, or each file's own if r is 0,
+// to every file. Returns the number of versions dropped.
+static int
+gc_prune(struct retention *r)
+{
+  uint inum;
+  int n, dropped;
+
+  dropped = 0;
+  for(inum = 1; (n = version_prune_inum(inum, r)) >= 0; inum++)
+    dropped += n;
+  return dropped;
+}
+
+// Drop every version older than age_threshold ticks, except
+// the newest of each file. Returns the number dropped.
+int
+gc_prune_old_versions(uint age_threshold)
+{
+  struct retention r;
+
+  if(age_threshold == 0)
+    return 0;
+  memset(&r, 0, sizeof(r));
+  r.recent = age_threshold;
+  return gc_prune(&r);
+}
+
+// Keep at most max_versions versions of each file.
+// Returns the number dropped.
+int
+gc_prune_by_count(uint max_versions)
+{
+  struct retention r;
+
+  if(max_versions == 0)
+    return 0;
+  memset(&r, 0, sizeof(r));
+  r.max = max_versions;
+  return gc_prune(&r);
+}
+
+// Free space until at least need blocks are free: collect
+// the garbage list, then drop the oldest unpinned versions.
+// Returns -1 if that much cannot be freed.
+// Caller must not be inside a transaction.
+int
+gc_reclaim(uint need)
+{
+  while(bfreecount() < need){
+    if(gc_run())
+      continue;
+    if(version_reclaim() == 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Each wakeup first brings every file within its retention
+// policy and frees what that left behind. If space is still
+// short it reclaims old versions up to the high watermark, so
+// foreground writes rarely have to.
+static void
+gc_thread(void)
+{
+  for(;;){
+    acquire(&gc.wlock);
+    while(!gc.wanted)
+      sleep(&gc, &gc.wlock);
+    gc.wanted = 0;
+    release(&gc.wlock);
+
+    gc_prune(0);
+    while(gc_run())
+      ;
+    if(bfreecount() < GC_LOWMARK(sb))
+      gc_reclaim(GC_HIGHMARK(sb));
+  }
+}
+
+// Initialize garbage collection.
+// Called once the log has been recovered.
 void
 gc_init(void)
 {
@@ -269,20 +921,18 @@ gc_init(void)
   dedup_init();
   
   gc_statistics.blocks_freed = 0;
+  gc_statistics.blocks_merged = 0;
   gc_statistics.versions_pruned = 0;
+  gc_statistics.versions_freed = 0;
   gc_statistics.last_run_time = 0;
   gc_statistics.total_runs = 0;
-}
 
-// Run garbage collection (placeholder - will be implemented later)
-int
-gc_run(void)
-{
-  // This will be implemented in Phase 8
-  // For now, just update statistics
-  gc_statistics.total_runs++;
-  gc_statistics.last_run_time = get_timestamp();
-  
-  return 0;
+  bcountinit(ROOTDEV);
+  initsleeplock(&gc.lock, "gc");
+  initlock(&gc.wlock, "gcwait");
+  gc.wanted = sb.gclist != 0;
+  memset(&gc.policy, 0, sizeof(gc.policy));
+  gc.policy.max = MAX_VERSIONS_PER_FILE;
+  // Background work: run only when nothing more urgent can.
+  setpriority(kthread("gc", gc_thread)->pid, NPRIO-1);
 }
-
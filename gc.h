@@ -3,38 +3,62 @@
 
 #include "types.h"
 
+struct dedup_stats;
+struct retention;
+
+// balloc() wakes the gc thread when fewer blocks than
+// GC_LOWMARK are free; it then reclaims old versions until
+// GC_HIGHMARK are.
+#define GC_LOWMARK(sb)  ((sb).nblocks / 10)
+#define GC_HIGHMARK(sb) ((sb).nblocks / 5)
+
 // Garbage collection functions
 void gc_init(void);
 int gc_run(void);
 int gc_collect_versions(void);
 int gc_collect_blocks(void);
+void gc_push(uint vblock);
+void gc_wakeup(void);
+int gc_reclaim(uint need);
 
 // Version pruning
 int gc_prune_old_versions(uint age_threshold);
 int gc_prune_by_count(uint max_versions);
+void retention_get(struct retention *r);
+void retention_set(struct retention *r);
 
 // Block reference counting
 void bref_init(void);
 int bref_inc(uint block_num);
 int bref_dec(uint block_num);
+int bref_share(uint block_num);
+int bref_share_live(uint block_num);
+int bref_drop(uint block_num);
 uint bref_get(uint block_num);
 void bref_set(uint block_num, uint count);
 
 // Deduplication functions
-uint dedup_hash(char *data, uint len);
-uint dedup_find(uint checksum);
-int dedup_insert(uint checksum, uint block_num);
-int dedup_remove(uint block_num);
+uint64 dedup_hash(char *data, uint len);
+uint dedup_find(uint64 fp);
+int dedup_insert(uint64 fp, uint block_num);
+int dedup_remove(uint64 fp, uint block_num);
+int dedup_live(uint block_num);
+void dedup_forget(uint block_num);
 void dedup_init(void);
+int dedup_config(int enable, struct dedup_stats *st);
 
 // GC statistics
 struct gc_stats {
   uint blocks_freed;
+  uint blocks_merged;     // Block pointers redirected by dedup_scan()
   uint versions_pruned;
+  uint versions_freed;    // Garbage version nodes freed
   uint last_run_time;
   uint total_runs;
 };
 
 extern struct gc_stats gc_statistics;
+extern int dedup_enabled;
+extern struct dedup_stats dedup_statistics;
 
 #endif // GC_H
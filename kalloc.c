@@ -7,6 +7,8 @@
 #include "param.h"
 #include "memlayout.h"
 #include "mmu.h"
+#include "x86.h"
+#include "proc.h"
 #include "spinlock.h"
 
 void freerange(void *vstart, void *vend);
@@ -23,6 +25,37 @@ struct {
   struct run *freelist;
 } kmem;
 
+// Per-CPU caches of free pages.
+// kalloc() and kfree() use the current CPU's cache, with
+// interrupts off, and take kmem.lock only to move a batch of
+// KBATCH pages between it and kmem.freelist: when the cache is
+// empty, or holds more than KCACHE pages. A CPU's cache can
+// hold on to a few pages while another CPU runs out.
+#define KBATCH 16
+#define KCACHE (4*KBATCH)
+
+struct kcache {
+  struct run *freelist;
+  int n;
+  struct run *zfree;      // zeroed pages, for kalloc_zeroed()
+  int nz;
+} kcache[NCPU];
+
+// Pool of zeroed pages.
+// The kzero thread, at the lowest priority, so mostly when a
+// CPU would otherwise be idle, zeroes free pages into the pool
+// until it holds ZPOOL; kalloc_zeroed() takes them in batches
+// of KBATCH into the per-CPU caches, and wakes the thread once
+// the pool is down to half. A page in the pool is all zero but
+// for its run link.
+#define ZPOOL (8*KBATCH)
+
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} zpool;
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -32,6 +65,7 @@ void
 kinit1(void *vstart, void *vend)
 {
   initlock(&kmem.lock, "kmem");
+  initlock(&zpool.lock, "zpool");
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -59,21 +93,69 @@ freerange(void *vstart, void *vend)
 void
 kfree(char *v)
 {
-  struct run *r;
+  struct run *r, *last;
+  struct kcache *c;
+  int i;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+#ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
+  if(!kmem.use_lock){
+    // Still in kinit; there is only one CPU.
+    r->next = kmem.freelist;
+    kmem.freelist = r;
+    return;
+  }
+
+  pushcli();
+  c = &kcache[cpuid()];
+  r->next = c->freelist;
+  c->freelist = r;
+  if(++c->n > KCACHE){
+    // Give a batch back.
+    for(i = 0, last = c->freelist; i < KBATCH - 1; i++)
+      last = last->next;
+    r = c->freelist;
+    c->freelist = last->next;
+    c->n -= KBATCH;
+    acquire(&kmem.lock);
+    last->next = kmem.freelist;
+    kmem.freelist = r;
+    release(&kmem.lock);
+  }
+  popcli();
+}
+
+// Take a page from CPU cache c or kmem.freelist, never one
+// of the zeroed pages. Returns 0 if there is none.
+// Caller must have interrupts off.
+static struct run*
+kalloc_free(struct kcache *c)
+{
+  struct run *r;
+
+  if(c->freelist == 0){
+    // Take a batch.
+    acquire(&kmem.lock);
+    while(c->n < KBATCH && (r = kmem.freelist) != 0){
+      kmem.freelist = r->next;
+      r->next = c->freelist;
+      c->freelist = r;
+      c->n++;
+    }
     release(&kmem.lock);
+  }
+  if((r = c->freelist) != 0){
+    c->freelist = r->next;
+    c->n--;
+  }
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +165,117 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kcache *c;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    if((r = kmem.freelist) != 0)
+      kmem.freelist = r->next;
+    return (char*)r;
+  }
+
+  pushcli();
+  c = &kcache[cpuid()];
+  if((r = kalloc_free(c)) == 0 && (r = c->zfree) != 0){
+    // Out of other pages; these will do.
+    c->zfree = r->next;
+    c->nz--;
+  }
+  popcli();
+  if(r == 0){
+    acquire(&zpool.lock);
+    if((r = zpool.freelist) != 0){
+      zpool.freelist = r->next;
+      zpool.n--;
+    }
+    release(&zpool.lock);
+  }
+  return (char*)r;
+}
+
+// Allocate one 4096-byte page of physical memory, filled with
+// zeros. Returns 0 if the memory cannot be allocated.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+  struct kcache *c;
+  int wake;
+
+  r = 0;
+  wake = 0;
+  if(kmem.use_lock){
+    pushcli();
+    c = &kcache[cpuid()];
+    if(c->zfree == 0 && zpool.n > 0){
+      // Take a batch.
+      acquire(&zpool.lock);
+      while(c->nz < KBATCH && (r = zpool.freelist) != 0){
+        zpool.freelist = r->next;
+        zpool.n--;
+        r->next = c->zfree;
+        c->zfree = r;
+        c->nz++;
+      }
+      wake = zpool.n < ZPOOL/2;
+      release(&zpool.lock);
+    }
+    if((r = c->zfree) != 0){
+      c->zfree = r->next;
+      c->nz--;
+    }
+    popcli();
+  }
+  if(wake)
+    wakeup(&zpool);
+
+  if(r){
+    r->next = 0;
+    return (char*)r;
+  }
+  // The pool is empty: zero one here.
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
   return (char*)r;
 }
 
+// Keep the zeroed pool full, from pages that are not zeroed
+// yet: kalloc() would hand back the pool's own pages once the
+// others run out.
+static void
+kzero(void)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&zpool.lock);
+    while(zpool.n >= ZPOOL)
+      sleep(&zpool, &zpool.lock);
+    release(&zpool.lock);
+
+    pushcli();
+    r = kalloc_free(&kcache[cpuid()]);
+    popcli();
+    if(r == 0){
+      // No unzeroed pages left; try again later.
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+      continue;
+    }
+    memset(r, 0, PGSIZE);
+    acquire(&zpool.lock);
+    r->next = zpool.freelist;
+    zpool.freelist = r;
+    zpool.n++;
+    release(&zpool.lock);
+  }
+}
+
+// Start the kzero thread. Called from the first process,
+// like the other kernel threads.
+void
+kzinit(void)
+{
+  setpriority(kthread("kzero", kzero)->pid, NPRIO-1);
+}
+
@@ -0,0 +1,45 @@
+// Page allocator throughput: fork nproc children that each
+// grow their memory by npages pages and shrink it back, n
+// times, and report pages allocated and freed per tick. Run it
+// with different CPUS to see how kalloc() scales.
+//
+//   kallocbench [nproc [n [npages]]]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "mmu.h"
+
+int
+main(int argc, char *argv[])
+{
+  int nproc, n, npages, i, j, t0, t;
+
+  nproc = argc > 1 ? atoi(argv[1]) : 4;
+  n = argc > 2 ? atoi(argv[2]) : 1000;
+  npages = argc > 3 ? atoi(argv[3]) : 32;
+
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    if(fork() == 0){
+      for(j = 0; j < n; j++){
+        if(sbrk(npages*PGSIZE) == (char*)-1){
+          printf(2, "kallocbench: out of memory\n");
+          exit();
+        }
+        sbrk(-npages*PGSIZE);
+      }
+      exit();
+    }
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  t = uptime() - t0;
+
+  printf(1, "kallocbench: %d procs x %d x %d pages in %d ticks",
+         nproc, n, npages, t);
+  if(t > 0)
+    printf(1, ", %d pages/tick", nproc*n*npages/t);
+  printf(1, "\n");
+  exit();
+}
@@ -113,6 +113,37 @@ lapiceoi(void)
     lapicw(EOI, 0);
 }
 
+// Send interrupt vector vec to the CPU with the given APIC ID.
+// Caller must have interrupts disabled, since the two ICR
+// writes must not be interleaved with another IPI.
+void
+lapicipi(uchar apicid, int vec)
+{
+  if(!lapic)
+    return;
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | ASSERT | vec);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+// Stop (on == 0) or restart this CPU's timer.
+// An idle CPU with no timer duties stops it so that it is not
+// woken from hlt every tick for nothing.
+void
+lapictimer(int on)
+{
+  if(!lapic)
+    return;
+  if(on){
+    lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, 10000000);
+  } else {
+    lapicw(TIMER, MASKED | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, 0);
+  }
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void
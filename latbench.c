@@ -0,0 +1,102 @@
+// Scheduling latency under load: start nhog CPU-bound children,
+// then time n round trips to a short interactive task, and
+// report the latency distribution in ticks. -l runs the hogs at
+// the lowest priority.
+//
+//   latbench [-l] [nhog [n]]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+
+#define MAXN 500
+
+int lat[MAXN];
+
+// Echo each byte from in to out after a little work.
+static void
+echo(int in, int out)
+{
+  volatile int i;
+  char c;
+
+  while(read(in, &c, 1) == 1){
+    for(i = 0; i < 10000; i++)
+      ;
+    write(out, &c, 1);
+  }
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int low, nhog, n, i, j, t, hog[NPROC];
+  int to[2], from[2];
+  char c;
+
+  low = 0;
+  if(argc > 1 && strcmp(argv[1], "-l") == 0){
+    low = 1;
+    argc--;
+    argv++;
+  }
+  nhog = argc > 1 ? atoi(argv[1]) : 4;
+  n = argc > 2 ? atoi(argv[2]) : 100;
+  if(nhog > NPROC/2)
+    nhog = NPROC/2;
+  if(n < 1)
+    n = 1;
+  if(n > MAXN)
+    n = MAXN;
+
+  if(pipe(to) < 0 || pipe(from) < 0){
+    printf(2, "latbench: pipe failed\n");
+    exit();
+  }
+  if(fork() == 0){
+    close(to[1]);
+    close(from[0]);
+    echo(to[0], from[1]);
+  }
+  close(to[0]);
+  close(from[1]);
+
+  for(i = 0; i < nhog; i++){
+    if((hog[i] = fork()) == 0){
+      for(;;)
+        ;
+    }
+    if(low)
+      setpriority(hog[i], NPRIO-1);
+  }
+
+  c = 'x';
+  for(i = 0; i < n; i++){
+    sleep(1);
+    t = uptime();
+    write(to[1], &c, 1);
+    read(from[0], &c, 1);
+    lat[i] = uptime() - t;
+  }
+
+  for(i = 0; i < nhog; i++)
+    kill(hog[i]);
+  close(to[1]);
+  for(i = 0; i < nhog + 1; i++)
+    wait();
+
+  // Insertion sort; n is small.
+  for(i = 1; i < n; i++){
+    t = lat[i];
+    for(j = i; j > 0 && lat[j-1] > t; j--)
+      lat[j] = lat[j-1];
+    lat[j] = t;
+  }
+  printf(1, "latbench: %d hogs%s, %d round trips: "
+         "p50 %d p90 %d p99 %d max %d ticks\n",
+         nhog, low ? " (low priority)" : "", n,
+         lat[n/2], lat[n*9/10], lat[n*99/100], lat[n-1]);
+  exit();
+}
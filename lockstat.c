@@ -0,0 +1,37 @@
+// Print spinlock contention statistics, one line per lock
+// name, most contended first.
+//
+//   lockstat
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "spinlock.h"
+
+struct lockstat st[NLOCKSTAT];
+
+int
+main(void)
+{
+  struct lockstat t;
+  int n, i, j;
+
+  if((n = lockstat(st, NLOCKSTAT)) < 0){
+    printf(2, "lockstat: failed\n");
+    exit();
+  }
+
+  // Insertion sort by cycles spent waiting.
+  for(i = 1; i < n; i++){
+    t = st[i];
+    for(j = i; j > 0 && st[j-1].spin < t.spin; j--)
+      st[j] = st[j-1];
+    st[j] = t;
+  }
+
+  for(i = 0; i < n; i++)
+    printf(1, "%s: %d acquires, %d contended, %d kcycles spinning, "
+           "max hold %d cycles\n", st[i].name, st[i].nacquire,
+           st[i].ncontend, (uint)(st[i].spin >> 10), st[i].maxhold);
+  exit();
+}
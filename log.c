@@ -42,6 +42,8 @@ struct log {
   int size;
   int outstanding; // how many FS sys calls are executing.
   int committing;  // in commit(), please wait.
+  int exclusive;   // an exclusive op is running; others wait.
+  int reserve;     // refcount blocks commit() may add beyond MAXOPBLOCKS
   int dev;
   struct logheader lh;
 };
@@ -61,6 +63,7 @@ initlog(int dev)
   readsb(dev, &sb);
   log.start = sb.logstart;
   log.size = sb.nlog;
+  log.reserve = sb.nrefblocks;
   log.dev = dev;
   recover_from_log();
 }
@@ -127,9 +130,9 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.exclusive){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS + log.reserve > LOGSIZE){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -140,6 +143,21 @@ begin_op(void)
   }
 }
 
+// Like begin_op(), but waits for all other FS system calls
+// to finish and keeps new ones out until the matching end_op().
+// For operations that need a stable view of the whole file
+// system, such as taking a snapshot.
+void
+begin_op_exclusive(void)
+{
+  acquire(&log.lock);
+  while(log.committing || log.exclusive || log.outstanding > 0)
+    sleep(&log, &log.lock);
+  log.exclusive = 1;
+  log.outstanding = 1;
+  release(&log.lock);
+}
+
 // called at the end of each FS system call.
 // commits if this was the last outstanding operation.
 void
@@ -154,6 +172,7 @@ end_op(void)
   if(log.outstanding == 0){
     do_commit = 1;
     log.committing = 1;
+    log.exclusive = 0;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -192,6 +211,7 @@ write_log(void)
 static void
 commit()
 {
+  bref_commit();     // Log the transaction's refcount changes
   if (log.lh.n > 0) {
     write_log();     // Write modified blocks from cache to log
     write_head();    // Write header to disk -- the real commit
@@ -217,7 +237,7 @@ log_write(struct buf *b)
 
   if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (log.outstanding < 1 && !log.committing)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
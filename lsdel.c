@@ -0,0 +1,33 @@
+// List deleted files that recover can bring back.
+//
+//   lsdel
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+#define PAGE 8
+
+int
+main(void)
+{
+  struct deleted_entry de[PAGE];
+  uint cursor;
+  int i, n, total;
+
+  printf(1, "DELETED   INUM  PATH\n");
+  total = 0;
+  cursor = 0;
+  while((n = deleted_list(&cursor, de, PAGE)) > 0){
+    for(i = 0; i < n; i++)
+      printf(1, "%d\t  %d\t%s\n", de[i].delete_time, de[i].inum, de[i].path);
+    total += n;
+  }
+  if(n < 0){
+    printf(2, "lsdel: cannot read the registry\n");
+    exit();
+  }
+  printf(1, "%d deleted files\n", total);
+  exit();
+}
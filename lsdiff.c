@@ -0,0 +1,76 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+#define NDIFF 64
+
+static char *kinds[] = {
+[DIFF_ADDED]    "added   ",
+[DIFF_REMOVED]  "removed ",
+[DIFF_MODIFIED] "modified",
+};
+
+struct diff_entry diffs[NDIFF];
+
+void
+usage(void)
+{
+  printf(1, "Usage: lsdiff <snapshot_a> <snapshot_b>\n");
+  printf(1, "       lsdiff -v <file> <version_a> <version_b>\n");
+  printf(1, "Use - for the live file system or current content.\n");
+  exit();
+}
+
+void
+show(int n)
+{
+  struct diff_entry *d;
+  int i;
+
+  if(n == 0){
+    printf(1, "No differences\n");
+    return;
+  }
+
+  printf(1, "Inode  Change    Blocks     Size\n");
+  for(i = 0; i < n && i < NDIFF; i++){
+    d = &diffs[i];
+    printf(1, "%d      %s  ", d->inum, kinds[d->type]);
+    if(d->nblocks == 0)
+      printf(1, "-          ");
+    else
+      printf(1, "%d-%d      ", d->start, d->start + d->nblocks - 1);
+    printf(1, "%d -> %d\n", d->size_a, d->size_b);
+  }
+  if(n > NDIFF)
+    printf(1, "(%d more ranges not shown)\n", n - NDIFF);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc == 3){
+    // Compare two snapshots; the kernel compares block maps only
+    n = snapshot_diff(strcmp(argv[1], "-") == 0 ? "" : argv[1],
+                      strcmp(argv[2], "-") == 0 ? "" : argv[2],
+                      diffs, NDIFF);
+  } else if(argc == 5 && strcmp(argv[1], "-v") == 0){
+    n = version_diff(argv[2],
+                     strcmp(argv[3], "-") == 0 ? -1 : atoi(argv[3]),
+                     strcmp(argv[4], "-") == 0 ? -1 : atoi(argv[4]),
+                     diffs, NDIFF);
+  } else {
+    usage();
+    n = -1;
+  }
+
+  if(n < 0){
+    printf(2, "lsdiff: cannot compare\n");
+    exit();
+  }
+  show(n);
+  exit();
+}
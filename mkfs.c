@@ -18,12 +18,15 @@
 #define NINODES 200
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
+// [ boot block | sb block | log | inode blocks | free bit map | refcounts |
+//   data blocks ]
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
+int nrefblocks = FSSIZE/RPB + 1;
+int ndelblocks = (MAX_DELETED_TRACK + DPB - 1) / DPB;
 int ninodeblocks = NINODES / IPB + 1;
 int nlog = LOGSIZE;
-int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
+int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap, refcounts, registry)
 int nblocks;  // Number of data blocks
 
 int fsfd;
@@ -83,6 +86,7 @@ main(int argc, char *argv[])
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert((BSIZE % sizeof(struct deleted_entry)) == 0);
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -91,7 +95,7 @@ main(int argc, char *argv[])
   }
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
+  nmeta = 2 + nlog + ninodeblocks + nbitmap + nrefblocks + ndelblocks;
   nblocks = FSSIZE - nmeta;
 
   sb.size = xint(FSSIZE);
@@ -101,9 +105,13 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.refstart = xint(2+nlog+ninodeblocks+nbitmap);
+  sb.nrefblocks = xint(nrefblocks);
+  sb.delstart = xint(2+nlog+ninodeblocks+nbitmap+nrefblocks);
+  sb.ndelblocks = xint(ndelblocks);
 
-  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+  printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u, refcount blocks %u, registry blocks %u) blocks %d total %d\n",
+         nmeta, nlog, ninodeblocks, nbitmap, nrefblocks, ndelblocks, nblocks, FSSIZE);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
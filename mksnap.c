@@ -5,25 +5,20 @@
 int
 main(int argc, char *argv[])
 {
-  if(argc < 3){
-    printf(1, "Usage: mksnap <name> <file1> [file2] [file3] ...\n");
+  int id;
+
+  if(argc != 2){
+    printf(1, "Usage: mksnap <name>\n");
     exit();
   }
 
-  char *snapshot_name = argv[1];
-  int num_files = argc - 2;
-  int i;
-
-  printf(1, "Creating snapshot '%s' with %d file(s)...\n", snapshot_name, num_files);
-
-  // Version each file with the snapshot name as description
-  for(i = 0; i < num_files; i++){
-    printf(1, "Versioning %s...\n", argv[2 + i]);
-    if(version_create(argv[2 + i], snapshot_name) < 0){
-      printf(2, "mksnap: failed to version %s\n", argv[2 + i]);
-    }
+  // The kernel freezes the whole file system in one transaction
+  id = snapshot_create(argv[1]);
+  if(id < 0){
+    printf(2, "mksnap: failed to create snapshot '%s'\n", argv[1]);
+    exit();
   }
 
-  printf(1, "Snapshot '%s' created successfully\n", snapshot_name);
+  printf(1, "Snapshot '%s' created (ID: %d)\n", argv[1], id);
   exit();
 }
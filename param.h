@@ -1,14 +1,17 @@
 #define NPROC        64  // maximum number of processes
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NPRIO         4  // scheduling priority levels; 0 is highest
+#define BOOSTTICKS  100  // ticks between scheduler priority boosts
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
+#define NVNODE       32  // size of version node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define LOGSIZE      (MAXOPBLOCKS*7)  // max data blocks in on-disk log; fits a snapshot rollback
+#define NBUF         (MAXOPBLOCKS*8)  // size of disk block cache
+#define FSSIZE       2000  // size of file system in blocks
 
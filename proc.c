@@ -4,26 +4,412 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
 
+// ptable.lock protects process allocation and the parent
+// links, and must be taken before any process's lock.
+// Each process's own lock, plock(p), protects its state, chan
+// and killed fields and its place on a run queue.
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct spinlock plock[NPROC];
 } ptable;
 
+#define plock(p) (&ptable.plock[(p) - ptable.proc])
+
+// Per-CPU run queues.
+// Each CPU runs processes from the front of its own queue,
+// so choosing the next process is O(1) and takes no global lock.
+// A process that becomes runnable joins the queue of the CPU it
+// last ran on, whose cache is likely still warm; a CPU whose
+// queue is empty steals from the longest other queue.
+//
+// Each queue is a multi-level feedback queue: one FIFO list per
+// priority, served highest first. A process starts at its base
+// priority and drops a level each time it uses up its slice,
+// which doubles at each level, so CPU-bound processes sink and
+// get longer but rarer turns. A process woken from sleep goes
+// back to its base, so one that mostly waits for I/O stays on
+// top. Every BOOSTTICKS ticks everything goes back to its base,
+// so nothing starves. While a process is queued, its prio is
+// protected by the queue's lock.
+#define QUANTUM(prio) (1 << (prio))   // slice in ticks
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;                      // length, read without the lock
+};
+
+static struct runq runq[NCPU];
+static uint boostgen;
+
+// Sleep queues.
+// A sleeping process is on the queue that its chan hashes to,
+// so wakeup() looks only at processes that might be waiting on
+// its chan. Each queue's lock is taken before the locks of the
+// processes on it.
+#define NSLEEPQ 64
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+};
+
+static struct sleepq sleepq[NSLEEPQ];
+
+static struct sleepq*
+chanq(void *chan)
+{
+  return &sleepq[(((uint)chan * 2654435761U) >> 16) % NSLEEPQ];
+}
+
 static struct proc *initproc;
 
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
 
-static void wakeup1(void *chan);
-
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NPROC; i++)
+    initlock(&ptable.plock[i], "proc");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
+}
+
+// Wake an idle CPU to run p, just queued on CPU id's run
+// queue: CPU id itself if it is idle, or else any idle CPU that
+// p may run on, which will steal it. Pairs with the check in
+// idle().
+static void
+kick(struct proc *p, int id)
+{
+  int i;
+
+  // The enqueue must be visible before idle is read.
+  __sync_synchronize();
+  if(!cpus[id].idle){
+    for(i = 0; i < ncpu; i++)
+      if(cpus[i].idle && (p->affinity & (1 << i)))
+        break;
+    if(i == ncpu)
+      return;
+    id = i;
+  }
+  // An interrupt on an idle CPU may queue work for it;
+  // it will look at its queue when the interrupt returns.
+  if(id != cpuid())
+    lapicipi(cpus[id].apicid, T_IRQ0 + IRQ_WAKEUP);
+}
+
+// Append p to the list for its priority. Caller must hold
+// rq->lock, and account for p in rq->n.
+static void
+enqueue(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+}
+
+// The least loaded CPU that p may run on.
+static int
+allowed(struct proc *p)
+{
+  int i, id;
+
+  id = -1;
+  for(i = 0; i < ncpu; i++)
+    if((p->affinity & (1 << i)) && (id < 0 || runq[i].n < runq[id].n))
+      id = i;
+  if(id < 0)
+    panic("allowed");
+  return id;
+}
+
+// Mark p runnable and append it to the run queue of p->cpu,
+// or if p may not run there, of the least loaded CPU it may
+// run on. Caller must hold plock(p).
+static void
+ready(struct proc *p)
+{
+  struct runq *rq;
+
+  if(!(p->affinity & (1 << p->cpu)))
+    p->cpu = allowed(p);
+  rq = &runq[p->cpu];
+  if(p->gen != boostgen){
+    p->gen = boostgen;
+    p->prio = p->base;
+    p->slice = 0;
+  }
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  enqueue(rq, p);
+  rq->n++;
+  release(&rq->lock);
+  kick(p, p->cpu);
+}
+
+// Remove p from rq, after prev on its list (0 if it is first).
+// Caller must hold rq->lock.
+static void
+rqunlink(struct runq *rq, struct proc *p, struct proc *prev)
+{
+  if(prev)
+    prev->rqnext = p->rqnext;
+  else
+    rq->head[p->prio] = p->rqnext;
+  if(rq->tail[p->prio] == p)
+    rq->tail[p->prio] = prev;
+  rq->n--;
+}
+
+// Take p off rq, if it is there, to queue it again elsewhere.
+// Returns 1 if it was. Caller must hold rq->lock.
+static int
+unqueue(struct runq *rq, struct proc *p)
+{
+  struct proc *q, *prev;
+
+  prev = 0;
+  for(q = rq->head[p->prio]; q; prev = q, q = q->rqnext){
+    if(q == p){
+      rqunlink(rq, p, prev);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Remove and return the first process of the highest priority
+// on rq that may run on CPU id, or 0.
+static struct proc*
+dequeue(struct runq *rq, int id)
+{
+  struct proc *p, *prev;
+  int i;
+
+  if(rq->n == 0)
+    return 0;
+  acquire(&rq->lock);
+  for(i = 0; i < NPRIO; i++){
+    prev = 0;
+    for(p = rq->head[i]; p; prev = p, p = p->rqnext){
+      if(p->affinity & (1 << id)){
+        rqunlink(rq, p, prev);
+        release(&rq->lock);
+        return p;
+      }
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Put every queued process back at its base priority.
+// Called by CPU 0 every BOOSTTICKS ticks. Running processes
+// are boosted by ready() when they next queue, since their
+// gen is then out of date.
+void
+boost(void)
+{
+  struct runq *rq;
+  struct proc *p, *next, *list, **lp;
+  int i;
+
+  boostgen++;
+  for(rq = runq; rq < &runq[ncpu]; rq++){
+    if(rq->n == 0)
+      continue;
+    acquire(&rq->lock);
+    // Gather the lower lists in priority order, then requeue.
+    lp = &list;
+    for(i = 1; i < NPRIO; i++){
+      if(rq->head[i]){
+        *lp = rq->head[i];
+        lp = &rq->tail[i]->rqnext;
+      }
+      rq->head[i] = rq->tail[i] = 0;
+    }
+    *lp = 0;
+    for(p = list; p; p = next){
+      next = p->rqnext;
+      p->gen = boostgen;
+      p->prio = p->base;
+      p->slice = 0;
+      enqueue(rq, p);
+    }
+    release(&rq->lock);
+  }
+}
+
+// Charge a clock tick to the current process. Returns 1 if it
+// should yield: it has used up its slice, and so drops a level,
+// or a process of higher priority is waiting on its CPU.
+int
+timeslice(void)
+{
+  struct proc *p = myproc();
+  struct runq *rq = &runq[p->cpu];
+  int i, r;
+
+  acquire(plock(p));
+  r = 0;
+  if(++p->slice >= QUANTUM(p->prio)){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    r = 1;
+  }
+  for(i = 0; i < p->prio && !r; i++)
+    if(rq->head[i])
+      r = 1;
+  release(plock(p));
+  return r;
+}
+
+// Restrict process pid to the CPUs in mask, a bit per CPU.
+// Returns its old mask, or -1.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+  struct runq *rq;
+  uint old;
+  int move;
+
+  mask &= (1 << ncpu) - 1;
+  if(mask == 0)
+    return -1;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->affinity;
+      move = !(mask & (1 << p->cpu));
+      if(p->state == RUNNABLE){
+        // dequeue() reads a queued process's mask under the
+        // queue's lock. If p is queued where it may no longer
+        // run, queue it again elsewhere.
+        rq = &runq[p->cpu];
+        acquire(&rq->lock);
+        p->affinity = mask;
+        if(move && !unqueue(rq, p))
+          move = 0;
+        release(&rq->lock);
+        if(move)
+          ready(p);
+        move = 0;
+      } else
+        p->affinity = mask;
+      // Others move when they next queue; move ourselves now.
+      move = move && p == myproc();
+      release(plock(p));
+      if(move)
+        yield();
+      return old;
+    }
+    release(plock(p));
+  }
+  return -1;
+}
+
+// Set the base priority of process pid, 0 being the highest.
+// Returns its old base priority, or -1.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+  int old;
+
+  if(prio < 0 || prio >= NPRIO)
+    return -1;
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
+    if(p->pid == pid && p->state != UNUSED){
+      old = p->base;
+      p->base = prio;
+      // A queued process keeps its place until it next queues.
+      if(p->state != RUNNABLE){
+        p->prio = prio;
+        p->slice = 0;
+      }
+      release(plock(p));
+      return old;
+    }
+    release(plock(p));
+  }
+  return -1;
+}
+
+// Choose a process for CPU id to run: the next on its own
+// queue, or else one stolen from the longest other queue, or
+// any other queue, that may run here.
+static struct proc*
+pick(int id)
+{
+  struct proc *p;
+  int i, victim, n;
+
+  if((p = dequeue(&runq[id], id)) != 0)
+    return p;
+  victim = -1;
+  n = 0;
+  for(i = 0; i < ncpu; i++){
+    if(i != id && runq[i].n > n){
+      n = runq[i].n;
+      victim = i;
+    }
+  }
+  if(victim < 0)
+    return 0;
+  if((p = dequeue(&runq[victim], id)) != 0)
+    return p;
+  for(i = 0; i < ncpu; i++)
+    if(i != id && i != victim && (p = dequeue(&runq[i], id)) != 0)
+      return p;
+  return 0;
+}
+
+// Halt CPU id until there may be work for it, and return a
+// process for it to run or 0.
+// It is marked idle first, so that kick() sends it an IPI once
+// a process is queued; a process queued before that is caught
+// by looking once more. CPU 0's timer keeps ticks, the clock
+// behind sleep() and file timestamps, but other CPUs stop
+// theirs while halted: they have no timers to run.
+static struct proc*
+idle(struct cpu *c, int id)
+{
+  struct proc *p;
+
+  cli();
+  c->idle = 1;
+  __sync_synchronize();
+  if((p = pick(id)) == 0){
+    if(id != 0)
+      lapictimer(0);
+    stihlt();
+    cli();
+    if(id != 0)
+      lapictimer(1);
+  }
+  c->idle = 0;
+  return p;
 }
 
 // Must be called with interrupts disabled
@@ -88,6 +474,11 @@ allocproc(void)
 found:
   p->state = EMBRYO;
   p->pid = nextpid++;
+  p->base = p->prio = 0;
+  p->slice = 0;
+  p->gen = boostgen;
+  p->affinity = ~0;
+  p->migrations = 0;
 
   release(&ptable.lock);
 
@@ -146,11 +537,37 @@ userinit(void)
   // run this process. the acquire forces the above
   // writes to be visible, and the lock is also needed
   // because the assignment might not be atomic.
-  acquire(&ptable.lock);
+  acquire(plock(p));
 
-  p->state = RUNNABLE;
+  p->cpu = cpuid();
+  ready(p);
 
-  release(&ptable.lock);
+  release(plock(p));
+}
+
+// Start a kernel thread that runs fn, which must never return.
+// It has no user memory and runs entirely in the kernel.
+struct proc*
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread: no proc");
+  if((p->pgdir = setupkvm()) == 0)
+    panic("kthread: out of memory");
+  p->sz = 0;
+  p->parent = initproc;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  // forkret() "returns" to fn instead of trapret.
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  acquire(plock(p));
+  p->cpu = cpuid();
+  ready(p);
+  release(plock(p));
+  return p;
 }
 
 // Grow current process's memory by n bytes.
@@ -212,11 +629,14 @@ fork(void)
 
   pid = np->pid;
 
-  acquire(&ptable.lock);
+  acquire(plock(np));
 
-  np->state = RUNNABLE;
+  np->cpu = cpuid();
+  np->base = np->prio = curproc->base;
+  np->affinity = curproc->affinity;
+  ready(np);
 
-  release(&ptable.lock);
+  release(plock(np));
 
   return pid;
 }
@@ -250,19 +670,23 @@ exit(void)
   acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
-  wakeup1(curproc->parent);
+  wakeup(curproc->parent);
 
   // Pass abandoned children to init.
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->parent == curproc){
       p->parent = initproc;
       if(p->state == ZOMBIE)
-        wakeup1(initproc);
+        wakeup(initproc);
     }
   }
 
   // Jump into the scheduler, never to return.
+  // The parent cannot free us until the scheduler has
+  // released our lock, after the switch.
+  acquire(plock(curproc));
   curproc->state = ZOMBIE;
+  release(&ptable.lock);
   sched();
   panic("zombie exit");
 }
@@ -284,6 +708,7 @@ wait(void)
       if(p->parent != curproc)
         continue;
       havekids = 1;
+      acquire(plock(p));
       if(p->state == ZOMBIE){
         // Found one.
         pid = p->pid;
@@ -295,9 +720,11 @@ wait(void)
         p->name[0] = 0;
         p->killed = 0;
         p->state = UNUSED;
+        release(plock(p));
         release(&ptable.lock);
         return pid;
       }
+      release(plock(p));
     }
 
     // No point waiting if we don't have any children.
@@ -324,38 +751,49 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
-      // Switch to chosen process.  It is the process's job
-      // to release ptable.lock and then reacquire it
-      // before jumping back to us.
-      c->proc = p;
-      switchuvm(p);
-      p->state = RUNNING;
-
-      swtch(&(c->scheduler), p->context);
-      switchkvm();
+    if((p = pick(id)) == 0 && (p = idle(c, id)) == 0)
+      continue;
 
-      // Process is done running for now.
-      // It should have changed its p->state before coming back.
-      c->proc = 0;
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us. If it was just queued by
+    // another CPU, this waits until that CPU has switched
+    // away from it.
+    acquire(plock(p));
+    if(p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+    if(!(p->affinity & (1 << id))){
+      // setaffinity() moved it off this CPU after we took it.
+      ready(p);
+      release(plock(p));
+      continue;
+    }
+    if(p->cpu != id){
+      p->migrations++;
+      p->cpu = id;
     }
-    release(&ptable.lock);
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
 
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(plock(p));
   }
 }
 
-// Enter scheduler.  Must hold only ptable.lock
+// Enter scheduler.  Must hold only the process's lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -368,8 +806,8 @@ sched(void)
   int intena;
   struct proc *p = myproc();
 
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
+  if(!holding(plock(p)))
+    panic("sched p->lock");
   if(mycpu()->ncli != 1)
     panic("sched locks");
   if(p->state == RUNNING)
@@ -385,10 +823,12 @@ sched(void)
 void
 yield(void)
 {
-  acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  struct proc *p = myproc();
+
+  acquire(plock(p));  //DOC: yieldlock
+  ready(p);
   sched();
-  release(&ptable.lock);
+  release(plock(p));
 }
 
 // A fork child's very first scheduling by scheduler()
@@ -397,8 +837,8 @@ void
 forkret(void)
 {
   static int first = 1;
-  // Still holding ptable.lock from scheduler.
-  release(&ptable.lock);
+  // Still holding our lock from scheduler.
+  release(plock(myproc()));
 
   if (first) {
     // Some initialization functions must be run in the context
@@ -410,6 +850,9 @@ forkret(void)
     
     // ChronoFS initialization (after FS is ready)
     gc_init();
+    recovery_init();
+    snapshot_init();
+    kzinit();
     cprintf("ChronoFS: Initialized\n");
   }
 
@@ -422,6 +865,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *sq;
   
   if(p == 0)
     panic("sleep");
@@ -429,19 +873,21 @@ sleep(void *chan, struct spinlock *lk)
   if(lk == 0)
     panic("sleep without lk");
 
-  // Must acquire ptable.lock in order to
-  // change p->state and then call sched.
-  // Once we hold ptable.lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup runs with ptable.lock locked),
-  // so it's okay to release lk.
-  if(lk != &ptable.lock){  //DOC: sleeplock0
-    acquire(&ptable.lock);  //DOC: sleeplock1
-    release(lk);
-  }
+  // Must acquire chan's sleep queue lock before releasing
+  // lk: once we hold it, we can be guaranteed that we won't
+  // miss any wakeup (wakeup runs with it locked). Then our
+  // own lock, to change p->state and call sched.
+  sq = chanq(chan);
+  acquire(&sq->lock);  //DOC: sleeplock1
+  release(lk);
+  acquire(plock(p));
+
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sqnext = sq->head;
+  sq->head = p;
+  release(&sq->lock);
 
   sched();
 
@@ -449,32 +895,48 @@ sleep(void *chan, struct spinlock *lk)
   p->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &ptable.lock){  //DOC: sleeplock2
-    release(&ptable.lock);
-    acquire(lk);
-  }
+  release(plock(p));  //DOC: sleeplock2
+  acquire(lk);
 }
 
 //PAGEBREAK!
-// Wake up all processes sleeping on chan.
-// The ptable lock must be held.
+// Wake p, asleep on chan's queue sq.
+// Caller must hold sq->lock and plock(p).
 static void
-wakeup1(void *chan)
+wake(struct sleepq *sq, struct proc *p)
 {
-  struct proc *p;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  struct proc **pp;
+
+  for(pp = &sq->head; *pp != p; pp = &(*pp)->sqnext)
+    ;
+  *pp = p->sqnext;
+  // A process that waited, most likely for I/O, gets its
+  // base priority back.
+  p->prio = p->base;
+  p->slice = 0;
+  ready(p);
 }
 
 // Wake up all processes sleeping on chan.
+// Must be called without any process's lock held.
 void
 wakeup(void *chan)
 {
-  acquire(&ptable.lock);
-  wakeup1(chan);
-  release(&ptable.lock);
+  struct sleepq *sq = chanq(chan);
+  struct proc *p, *next;
+
+  acquire(&sq->lock);
+  for(p = sq->head; p; p = next){
+    next = p->sqnext;
+    if(p->chan != chan)
+      continue;
+    // p may still be on its way into sched() on another CPU;
+    // its lock is ours once it is off that CPU.
+    acquire(plock(p));
+    wake(sq, p);
+    release(plock(p));
+  }
+  release(&sq->lock);
 }
 
 // Kill the process with the given pid.
@@ -484,20 +946,41 @@ int
 kill(int pid)
 {
   struct proc *p;
+  struct sleepq *sq;
+  void *chan;
 
-  acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    acquire(plock(p));
     if(p->pid == pid){
       p->killed = 1;
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
-      release(&ptable.lock);
+      release(plock(p));
+      break;
+    }
+    release(plock(p));
+  }
+  if(p == &ptable.proc[NPROC])
+    return -1;
+
+  // Wake process from sleep if necessary. Its queue's lock
+  // comes first, so look up chan and then check it again.
+  for(;;){
+    acquire(plock(p));
+    chan = p->state == SLEEPING ? p->chan : 0;
+    release(plock(p));
+    if(chan == 0)
       return 0;
+    sq = chanq(chan);
+    acquire(&sq->lock);
+    acquire(plock(p));
+    if(p->state == SLEEPING && p->chan == chan){
+      wake(sq, p);
+      chan = 0;
     }
+    release(plock(p));
+    release(&sq->lock);
+    if(chan == 0)
+      return 0;
   }
-  release(&ptable.lock);
-  return -1;
 }
 
 //PAGEBREAK: 36
@@ -527,7 +1010,8 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s cpu%d prio %d migr %d", p->pid, state, p->name,
+            p->cpu, p->prio, p->migrations);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
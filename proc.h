@@ -8,6 +8,7 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  volatile uint idle;          // Halted in the scheduler, waiting for work?
 };
 
 extern struct cpu cpus[NCPU];
@@ -49,6 +50,15 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  int cpu;                     // CPU it last ran on; its run queue
+  struct proc *rqnext;         // Next on that run queue
+  struct proc *sqnext;         // Next on its sleep queue, if sleeping
+  int base;                    // Priority set by setpriority()
+  int prio;                    // Current priority, base or lower
+  int slice;                   // Ticks used of its slice at prio
+  uint gen;                    // Last boost it has seen
+  uint affinity;               // CPUs it may run on, a bit per CPU
+  uint migrations;             // Times it has moved to another CPU
 };
 
 // Process memory is laid out contiguously, low addresses first:
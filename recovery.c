@@ -0,0 +1,375 @@
+// ChronoFS: deleted-file registry.
+//
+// Unlinking a file that has versions records it here, by full
+// path, so it can be undeleted later, even after a reboot.
+//
+// The registry is a ring of struct deleted_entry laid out on disk
+// by mkfs (see DBLOCK) and changed only through the log. New
+// entries go at the ring's tail, so once the ring is full each
+// one overwrites the oldest entry. Each entry holds a reference
+// to its file's version chain, dropped when the entry goes.
+//
+// An in-memory index, built at boot, hashes each entry's path
+// to its slot, so a lookup reads one registry block instead of
+// scanning the ring. Entries for the same path are chained
+// newest first.
+//
+// reg.lock, a sleep-lock, serializes changes to the ring and
+// the index. reg.rw, a reader-writer lock, protects the index,
+// so lookups can run alongside each other and do not wait for
+// a change's disk writes: they copy the slots of a path from
+// the index, then read them and check, by seq, that each slot
+// still holds the entry the index described.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "rwlock.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+
+#define NDELHASH 256
+#define NCAND 8   // slots a lookup checks without reg.lock
+
+struct {
+  struct sleeplock lock;
+  struct rwlock rw;
+  uint n;                           // slots in the ring
+  uint tail;                        // next slot to fill
+  uint seq;                         // seq of the next entry
+  uchar used[MAX_DELETED_TRACK];    // slot holds an entry?
+  uint hash[MAX_DELETED_TRACK];     // pathhash() of its path
+  uint eseq[MAX_DELETED_TRACK];     // seq of its entry
+  ushort next[MAX_DELETED_TRACK];   // next slot+1 in its chain
+  ushort head[NDELHASH];            // first slot+1 in each chain
+} reg;
+
+extern struct superblock sb;
+
+// FNV-1a hash of a path.
+static uint
+pathhash(char *path)
+{
+  uint h;
+
+  h = 2166136261U;
+  for(; *path; path++){
+    h ^= (uchar)*path;
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Add slot to the front of its chain in the index.
+// Caller must hold reg.rw for writing, or be recovery_init().
+static void
+reg_link(uint slot, uint h, uint seq)
+{
+  reg.used[slot] = 1;
+  reg.hash[slot] = h;
+  reg.eseq[slot] = seq;
+  reg.next[slot] = reg.head[h % NDELHASH];
+  reg.head[h % NDELHASH] = slot + 1;
+}
+
+// Remove slot from the index.
+// Caller must hold reg.rw for writing.
+static void
+reg_unlink(uint slot)
+{
+  ushort *pp;
+
+  for(pp = &reg.head[reg.hash[slot] % NDELHASH]; *pp; pp = &reg.next[*pp - 1]){
+    if(*pp == slot + 1){
+      *pp = reg.next[slot];
+      break;
+    }
+  }
+  reg.used[slot] = 0;
+}
+
+static void
+reg_read(uint slot, struct deleted_entry *de)
+{
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, DBLOCK(slot, sb));
+  memmove(de, (struct deleted_entry*)bp->data + slot%DPB, sizeof(*de));
+  brelse(bp);
+}
+
+// Caller must be inside a transaction.
+static void
+reg_write(uint slot, struct deleted_entry *de)
+{
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, DBLOCK(slot, sb));
+  memmove((struct deleted_entry*)bp->data + slot%DPB, de, sizeof(*de));
+  log_write(bp);
+  brelse(bp);
+}
+
+// Find the newest entry for path, and copy it into *de.
+// Returns its slot, or -1. Caller must hold reg.lock, so the
+// index cannot change.
+static int
+reg_lookup(char *path, struct deleted_entry *de)
+{
+  uint h, slot;
+  ushort s;
+
+  h = pathhash(path);
+  for(s = reg.head[h % NDELHASH]; s; s = reg.next[slot]){
+    slot = s - 1;
+    if(reg.hash[slot] != h)
+      continue;
+    reg_read(slot, de);
+    if(strncmp(de->path, path, DELPATH) == 0)
+      return slot;
+  }
+  return -1;
+}
+
+// Like reg_lookup(), but without reg.lock.
+static int
+reg_find(char *path, struct deleted_entry *de)
+{
+  uint h, slot[NCAND], seq[NCAND];
+  ushort s;
+  int n, i;
+
+  h = pathhash(path);
+again:
+  n = 0;
+  acquireread(&reg.rw);
+  for(s = reg.head[h % NDELHASH]; s && n < NCAND; s = reg.next[s - 1]){
+    if(reg.hash[s - 1] == h){
+      slot[n] = s - 1;
+      seq[n++] = reg.eseq[s - 1];
+    }
+  }
+  releaseread(&reg.rw);
+
+  for(i = 0; i < n; i++){
+    reg_read(slot[i], de);
+    if(de->version_head == 0 || de->seq != seq[i])
+      goto again;  // changed since we looked at the index
+    if(strncmp(de->path, path, DELPATH) == 0)
+      return slot[i];
+  }
+  if(n < NCAND)
+    return -1;
+
+  // Too many entries share the hash; search properly.
+  acquiresleep(&reg.lock);
+  i = reg_lookup(path, de);
+  releasesleep(&reg.lock);
+  return i;
+}
+
+// Load the index from the registry on disk.
+// Called once the log has been recovered.
+void
+recovery_init(void)
+{
+  struct buf *bp;
+  struct deleted_entry *de;
+  uint i, slot, maxseq;
+  int found;
+
+  initsleeplock(&reg.lock, "deleted");
+  initrwlock(&reg.rw, "deleted");
+  reg.n = sb.ndelblocks * DPB;
+  if(reg.n > MAX_DELETED_TRACK)
+    reg.n = MAX_DELETED_TRACK;
+
+  // The newest entry is the one with the highest seq.
+  found = 0;
+  maxseq = 0;
+  for(i = 0; i < reg.n; i += DPB){
+    bp = bread(ROOTDEV, DBLOCK(i, sb));
+    for(slot = i; slot < i + DPB && slot < reg.n; slot++){
+      de = (struct deleted_entry*)bp->data + slot%DPB;
+      if(de->version_head == 0)
+        continue;
+      reg.used[slot] = 1;
+      reg.hash[slot] = pathhash(de->path);
+      reg.eseq[slot] = de->seq;
+      if(!found || de->seq > maxseq){
+        maxseq = de->seq;
+        reg.tail = slot + 1;
+        found = 1;
+      }
+    }
+    brelse(bp);
+  }
+  if(reg.n)
+    reg.tail %= reg.n;
+  reg.seq = found ? maxseq + 1 : 0;
+
+  // Chain oldest first, so the newest ends up in front.
+  for(i = 0; i < reg.n; i++){
+    slot = (reg.tail + i) % reg.n;
+    if(reg.used[slot])
+      reg_link(slot, reg.hash[slot], reg.eseq[slot]);
+  }
+}
+
+// Record that ip, which has versions, is being deleted from
+// path (a full path, see fullpath()). Returns -1 if it cannot
+// be recorded. Caller must hold ip->lock and be inside a
+// transaction.
+int
+recovery_register_deletion(struct inode *ip, char *path)
+{
+  struct deleted_entry de;
+  uint slot, evict;
+
+  if(ip->version_head == 0 || reg.n == 0 || strlen(path) >= DELPATH)
+    return -1;
+  if(bref_share(ip->version_head) < 0)
+    return -1;
+
+  acquiresleep(&reg.lock);
+  slot = reg.tail;
+  reg.tail = (slot + 1) % reg.n;
+  evict = 0;
+  if(reg.used[slot]){
+    // The ring is full: this is the oldest entry.
+    reg_read(slot, &de);
+    evict = de.version_head;
+    acquirewrite(&reg.rw);
+    reg_unlink(slot);
+    releasewrite(&reg.rw);
+  }
+
+  memset(&de, 0, sizeof(de));
+  safestrcpy(de.path, path, sizeof(de.path));
+  de.inum = ip->inum;
+  de.version_head = ip->version_head;
+  de.delete_time = get_timestamp();
+  de.seq = reg.seq++;
+  reg_write(slot, &de);
+  acquirewrite(&reg.rw);
+  reg_link(slot, pathhash(de.path), de.seq);
+  releasewrite(&reg.rw);
+  releasesleep(&reg.lock);
+
+  version_release(evict);
+  return 0;
+}
+
+// Copy the newest entry for path into *de.
+// Returns 0 if there is one, else -1.
+int
+recovery_find_deleted(char *path, struct deleted_entry *de)
+{
+  return reg_find(path, de) < 0 ? -1 : 0;
+}
+
+// Remove the newest entry for path. Returns its version head,
+// whose reference passes to the caller, or 0 if there is none.
+// Caller must be inside a transaction.
+uint
+recovery_clear_entry(char *path)
+{
+  struct deleted_entry de;
+  uint vhead;
+  int slot;
+
+  acquiresleep(&reg.lock);
+  vhead = 0;
+  if((slot = reg_lookup(path, &de)) >= 0){
+    vhead = de.version_head;
+    acquirewrite(&reg.rw);
+    reg_unlink(slot);
+    releasewrite(&reg.rw);
+    memset(&de, 0, sizeof(de));
+    reg_write(slot, &de);
+  }
+  releasesleep(&reg.lock);
+  return vhead;
+}
+
+// Copy up to max entries into buf, starting at slot *cursor,
+// and advance *cursor past them. Returns the number copied;
+// 0 means the listing is done.
+int
+list_deleted(uint *cursor, struct deleted_entry *buf, int max)
+{
+  int n, used;
+
+  for(n = 0; *cursor < reg.n && n < max; (*cursor)++){
+    acquireread(&reg.rw);
+    used = reg.used[*cursor];
+    releaseread(&reg.rw);
+    if(used){
+      reg_read(*cursor, &buf[n]);
+      if(buf[n].version_head)   // not removed since
+        n++;
+    }
+  }
+  return n;
+}
+
+// Bring back the file most recently deleted from path (a full
+// path) with the contents of its newest version. Its history
+// goes; the restored file shares the version's blocks.
+// Returns 0 on success, -1 if there is no such entry or
+// something else now exists at path.
+int
+undelete_file(char *path)
+{
+  struct inode *dp, *ip;
+  struct version_node *v;
+  struct deleted_entry de;
+  char name[DIRSIZ];
+
+  begin_op();
+  if((dp = nameiparent(path, name)) == 0){
+    end_op();
+    return -1;
+  }
+  ilock(dp);
+  // Holding dp keeps anyone else from undeleting into it.
+  if((ip = dirlookup(dp, name, 0)) != 0){
+    iput(ip);
+    goto bad;
+  }
+  if(recovery_find_deleted(path, &de) < 0)
+    goto bad;
+
+  if((ip = ialloc(dp->dev, T_FILE)) == 0)
+    goto bad;
+  ilock(ip);
+  ip->nlink = 1;
+  iupdate(ip);
+
+  // Share the latest version's blocks; later writes copy-on-write.
+  v = version_get(de.version_head);
+  if(version_restore(ip, v) < 0 || dirlink(dp, name, ip->inum) < 0){
+    version_put(v);
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    goto bad;
+  }
+  version_put(v);
+  iunlockput(ip);
+
+  // Still holding dp, so no newer entry for path can appear.
+  version_release(recovery_clear_entry(path));
+  iunlockput(dp);
+  end_op();
+  return 0;
+
+bad:
+  iunlockput(dp);
+  end_op();
+  return -1;
+}
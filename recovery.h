@@ -8,7 +8,7 @@
 int recover_file(char *path, uint timestamp);
 int undelete_file(char *path);
 int list_recoverable(struct recovery_entry *buf, int max);
-int list_deleted(struct deleted_entry *buf, int max);
+int list_deleted(uint *cursor, struct deleted_entry *buf, int max);
 
 // Time-travel functions
 struct inode* get_file_at_time(char *path, uint timestamp);
@@ -17,8 +17,8 @@ int list_versions(char *path, struct version_info *buf, int max);
 // Deleted file registry management
 void recovery_init(void);
 int recovery_register_deletion(struct inode *ip, char *path);
-struct deleted_entry* recovery_find_deleted(char *path);
-int recovery_clear_entry(char *path);
+int recovery_find_deleted(char *path, struct deleted_entry *de);
+uint recovery_clear_entry(char *path);
 
 // Version traversal
 int version_count(struct inode *ip);
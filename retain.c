@@ -0,0 +1,62 @@
+// Set the retention policy for a file's versions, or the
+// global one for files without their own.
+//
+//   retain [-n max] [-r recent] [-h hourly] [-d daily] [file]
+//   retain -c file
+//
+// Ages are in ticks. -c makes file follow the global policy.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+
+static void
+usage(void)
+{
+  printf(2, "usage: retain [-n max] [-r recent] [-h hourly] [-d daily] [file]\n");
+  printf(2, "       retain -c file\n");
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct retention r;
+  char *file;
+  int i, clear;
+
+  memset(&r, 0, sizeof(r));
+  clear = 0;
+  file = 0;
+  for(i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-c") == 0){
+      clear = 1;
+      continue;
+    }
+    if(argv[i][0] != '-'){
+      if(file)
+        usage();
+      file = argv[i];
+      continue;
+    }
+    if(i+1 >= argc)
+      usage();
+    switch(argv[i][1]){
+    case 'n': r.max = atoi(argv[++i]); break;
+    case 'r': r.recent = atoi(argv[++i]); break;
+    case 'h': r.hourly = atoi(argv[++i]); break;
+    case 'd': r.daily = atoi(argv[++i]); break;
+    default: usage();
+    }
+  }
+  if(clear && file == 0)
+    usage();
+
+  if(retention(file, clear ? 0 : &r) < 0){
+    printf(2, "retain: cannot set policy%s%s\n",
+           file ? " for " : "", file ? file : "");
+    exit();
+  }
+  exit();
+}
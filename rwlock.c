@@ -0,0 +1,93 @@
+// Reader-writer spin locks, for tables that are mostly read.
+// Any number of CPUs may hold one for reading at once, or one
+// CPU for writing. A waiting writer keeps new readers out, so
+// writers are not starved. Like spinlocks, they are held with
+// interrupts off and must not be held across sleep(). A CPU
+// must not take one for reading twice: a writer queued between
+// the two would deadlock it.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "rwlock.h"
+
+#define RW_WRITER 0x80000000
+
+void
+initrwlock(struct rwlock *rw, char *name)
+{
+  rw->name = name;
+  rw->cnt = 0;
+  rw->wwait = 0;
+  rw->cpu = 0;
+}
+
+void
+acquireread(struct rwlock *rw)
+{
+  uint c;
+
+  pushcli(); // disable interrupts to avoid deadlock.
+  if(holdingwrite(rw))
+    panic("acquireread");
+  for(;;){
+    c = *(volatile uint*)&rw->cnt;
+    if(!(c & RW_WRITER) && *(volatile uint*)&rw->wwait == 0 &&
+       __sync_val_compare_and_swap(&rw->cnt, c, c + 1) == c)
+      break;
+    pause();
+  }
+  // The compare-and-swap is a full barrier: the critical
+  // section's memory references happen after it.
+}
+
+void
+releaseread(struct rwlock *rw)
+{
+  if((rw->cnt & ~RW_WRITER) == 0)
+    panic("releaseread");
+  __sync_fetch_and_sub(&rw->cnt, 1);
+  popcli();
+}
+
+void
+acquirewrite(struct rwlock *rw)
+{
+  pushcli();
+  if(holdingwrite(rw))
+    panic("acquirewrite");
+  __sync_fetch_and_add(&rw->wwait, 1);
+  while(__sync_val_compare_and_swap(&rw->cnt, 0, RW_WRITER) != 0)
+    pause();
+  __sync_fetch_and_sub(&rw->wwait, 1);
+  rw->cpu = mycpu();
+}
+
+void
+releasewrite(struct rwlock *rw)
+{
+  if(!holdingwrite(rw))
+    panic("releasewrite");
+  rw->cpu = 0;
+  __sync_synchronize();
+  // No reader can get in while RW_WRITER is set, so the count
+  // is exactly RW_WRITER; clearing it is a single store.
+  asm volatile("movl $0, %0" : "+m" (rw->cnt) : );
+  popcli();
+}
+
+// Check whether this cpu holds rw for writing.
+int
+holdingwrite(struct rwlock *rw)
+{
+  int r;
+
+  pushcli();
+  r = (rw->cnt & RW_WRITER) && rw->cpu == mycpu();
+  popcli();
+  return r;
+}
@@ -0,0 +1,10 @@
+// Reader-writer spin locks
+struct rwlock {
+  uint cnt;          // Readers holding it, plus RW_WRITER if a writer does
+  uint wwait;        // Writers waiting; new readers wait behind them
+
+  // For debugging:
+  char *name;        // Name of lock.
+  struct cpu *cpu;   // The cpu of the writer holding the lock.
+};
+
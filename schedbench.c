@@ -0,0 +1,36 @@
+// Context-switch throughput: fork nproc children that each
+// yield n times, and report yields per tick. Run it with
+// different CPUS to see how scheduling scales.
+//
+//   schedbench [nproc [n]]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int nproc, n, i, j, t0, t;
+
+  nproc = argc > 1 ? atoi(argv[1]) : 8;
+  n = argc > 2 ? atoi(argv[2]) : 10000;
+
+  t0 = uptime();
+  for(i = 0; i < nproc; i++){
+    if(fork() == 0){
+      for(j = 0; j < n; j++)
+        yield();
+      exit();
+    }
+  }
+  for(i = 0; i < nproc; i++)
+    wait();
+  t = uptime() - t0;
+
+  printf(1, "schedbench: %d procs x %d yields in %d ticks", nproc, n, t);
+  if(t > 0)
+    printf(1, ", %d yields/tick", nproc*n/t);
+  printf(1, "\n");
+  exit();
+}
@@ -1,4 +1,11 @@
 // Sleeping locks
+//
+// Taking a free lock, or releasing one nobody waits for, is a
+// single atomic exchange. A process that finds the lock held
+// spins for a while first if the holder is running on another
+// CPU, since it will likely release the lock soon (most are held
+// only across a cached bread() or an inode update), and
+// sleeps only if it does not.
 
 #include "types.h"
 #include "defs.h"
@@ -10,47 +17,84 @@
 #include "spinlock.h"
 #include "sleeplock.h"
 
+#define SPINMAX 10000   // pause()s to spin before sleeping
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->waiters = 0;
+  lk->owner = 0;
   lk->pid = 0;
 }
 
+// Spin while lk is held by a process running on another CPU,
+// for at most SPINMAX rounds. The owner may change under us;
+// this is only a guess at whether sleeping can be avoided.
+static void
+spinsleep(struct sleeplock *lk)
+{
+  struct proc *owner;
+  int i;
+
+  for(i = 0; i < SPINMAX && lk->locked; i++){
+    owner = lk->owner;
+    if(owner == 0 || owner->state != RUNNING)
+      break;
+    pause();
+  }
+}
+
 void
 acquiresleep(struct sleeplock *lk)
 {
-  acquire(&lk->lk);
-  while (lk->locked) {
-    sleep(lk, &lk->lk);
+  if(xchg(&lk->locked, 1) != 0){
+    spinsleep(lk);
+    if(xchg(&lk->locked, 1) != 0){
+      // Being counted in waiters before trying again means
+      // releasesleep() either lets us in or wakes us.
+      acquire(&lk->lk);
+      lk->waiters++;
+      // xchg() is not a compiler barrier; publish waiters
+      // before testing locked again.
+      __sync_synchronize();
+      while(xchg(&lk->locked, 1) != 0)
+        sleep(lk, &lk->lk);
+      lk->waiters--;
+      release(&lk->lk);
+    }
   }
-  lk->locked = 1;
-  lk->pid = myproc()->pid;
-  release(&lk->lk);
+  // Keep the critical section's loads and stores after this.
+  __sync_synchronize();
+  lk->owner = myproc();
+  lk->pid = lk->owner->pid;
 }
 
 void
 releasesleep(struct sleeplock *lk)
 {
-  acquire(&lk->lk);
-  lk->locked = 0;
+  lk->owner = 0;
   lk->pid = 0;
-  wakeup(lk);
-  release(&lk->lk);
+  // Keep the critical section's loads and stores before this.
+  __sync_synchronize();
+  xchg(&lk->locked, 0);
+  // Clear locked before loading waiters, or a process counted
+  // in waiters just after we looked could sleep with nobody to
+  // wake it. The CPU keeps that order for a locked xchg, but
+  // the compiler needs a barrier as well.
+  __sync_synchronize();
+  if(lk->waiters){
+    acquire(&lk->lk);
+    wakeup(lk);
+    release(&lk->lk);
+  }
 }
 
+// Only the holder sets owner to itself, so no lock is needed.
 int
 holdingsleep(struct sleeplock *lk)
 {
-  int r;
-  
-  acquire(&lk->lk);
-  r = lk->locked && (lk->pid == myproc()->pid);
-  release(&lk->lk);
-  return r;
+  return lk->locked && lk->owner == myproc();
 }
-
-
-
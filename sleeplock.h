@@ -1,8 +1,10 @@
 // Long-term locks for processes
 struct sleeplock {
   uint locked;       // Is the lock held?
-  struct spinlock lk; // spinlock protecting this sleep lock
-  
+  struct spinlock lk; // spinlock protecting waiters and sleeping
+  uint waiters;      // Processes sleeping, or about to, on the lock
+  struct proc *owner; // Process holding lock
+
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
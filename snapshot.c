@@ -0,0 +1,707 @@
+// ChronoFS snapshots.
+//
+// A snapshot is a point-in-time view of the whole file system.
+// Taking one costs a pass over the inode blocks and never
+// copies file data:
+//   + Every block a live inode points at gains a reference
+//     (bref_share), so writei() copies it and itrunc() keeps
+//     it instead of changing or freeing it in place.
+//   + Inode blocks are copied lazily. The first time an inode
+//     block changes while snapshot S is the newest,
+//     snapshot_cow() saves the old contents and records the
+//     copy in S's itable. Older snapshots find their copy in
+//     the nearest newer snapshot that has one.
+//
+// Each snapshot's struct snapshot_block lives in the first data
+// block of one of the reserved snapshot inodes
+// (SNAPSHOT_INODE_START..SNAPSHOT_INODE_END), which have type
+// T_SNAP and never appear in a directory.
+//
+// snapshot_create() runs as an exclusive log operation, so no
+// other FS system call is in progress while the blocks are
+// pinned and the whole snapshot commits in one transaction.
+// snapshot_lock protects the in-memory table below. It is a
+// reader-writer lock: snapshot_cow() checks it on every inode
+// block write, but it changes only when a block is first
+// copied or a snapshot is created.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "rwlock.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+#include "gc.h"
+
+extern struct superblock sb;
+
+struct snapshot {
+  uint inum;                  // reserved inode holding it, 0 if free
+  uint mblock;                // block holding blk on disk
+  struct snapshot_block blk;  // in-memory copy of that block
+};
+
+struct snapshot snapshots[MAX_SNAPSHOTS];
+struct rwlock snapshot_lock;
+
+static struct snapshot *newest;  // receives inode block copies
+static uint nextid = 1;
+static uint ninodeblocks;
+
+// Load the snapshots recorded in the reserved inodes.
+// Must run after initlog() has recovered the disk.
+void
+snapshot_init(void)
+{
+  uint inum, mblock;
+  struct buf *bp;
+  struct dinode *dip;
+  struct snapshot *s;
+
+  initrwlock(&snapshot_lock, "snapshots");
+  memset(snapshots, 0, sizeof(snapshots));
+
+  ninodeblocks = sb.ninodes/IPB + 1;
+  if(ninodeblocks > SNAPSHOT_NIBLOCKS)
+    panic("snapshot_init: too many inode blocks");
+
+  s = snapshots;
+  for(inum = SNAPSHOT_INODE_START; inum <= SNAPSHOT_INODE_END && inum < sb.ninodes; inum++){
+    bp = bread(ROOTDEV, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    mblock = dip->type == T_SNAP ? dip->addrs[0] : 0;
+    brelse(bp);
+    if(mblock == 0 || s == &snapshots[MAX_SNAPSHOTS])
+      continue;
+
+    bp = bread(ROOTDEV, mblock);
+    memmove(&s->blk, bp->data, sizeof(s->blk));
+    brelse(bp);
+    s->inum = inum;
+    s->mblock = mblock;
+    if(newest == 0 || s->blk.meta.id > newest->blk.meta.id)
+      newest = s;
+    if(s->blk.meta.id >= nextid)
+      nextid = s->blk.meta.id + 1;
+    s++;
+  }
+}
+
+// Write s's in-memory block back through the log.
+static void
+snapshot_write(struct snapshot *s)
+{
+  struct buf *bp;
+
+  bp = bread(ROOTDEV, s->mblock);
+  acquireread(&snapshot_lock);
+  memmove(bp->data, &s->blk, sizeof(s->blk));
+  releaseread(&snapshot_lock);
+  log_write(bp);
+  brelse(bp);
+}
+
+// Called with bp locked just before an inode block is changed.
+// If the newest snapshot still sees this block live, save a
+// copy of it for that snapshot first.
+// Runs inside an ordinary log operation, so snapshots cannot
+// be created or removed underneath it.
+void
+snapshot_cow(struct buf *bp)
+{
+  struct snapshot *s;
+  struct buf *cbp;
+  uint i, copy;
+
+  if(bp->blockno < sb.inodestart || bp->blockno >= sb.inodestart + ninodeblocks)
+    return;
+  i = bp->blockno - sb.inodestart;
+
+  acquireread(&snapshot_lock);
+  s = newest;
+  if(s == 0 || s->blk.itable[i] != 0){
+    releaseread(&snapshot_lock);
+    return;
+  }
+  releaseread(&snapshot_lock);
+
+  if((copy = ballocsnap(bp->dev)) == 0)
+    panic("snapshot_cow: out of blocks");
+  cbp = bread(bp->dev, copy);
+  memmove(cbp->data, bp->data, BSIZE);
+  log_write(cbp);
+  brelse(cbp);
+
+  acquirewrite(&snapshot_lock);
+  s->blk.itable[i] = copy;
+  releasewrite(&snapshot_lock);
+  snapshot_write(s);
+}
+
+// Take a reference on every block a live inode points at,
+// so nothing the snapshot can see is changed or freed in place.
+// Blocks listed in an indirect block are covered by the
+// reference on the indirect block itself.
+static void
+snapshot_pin(struct snapshot_metadata *meta)
+{
+  uint b, i, j, inum;
+  struct buf *bp;
+  struct dinode *dip;
+
+  for(b = 0; b < ninodeblocks; b++){
+    bp = bread(ROOTDEV, sb.inodestart + b);
+    for(i = 0; i < IPB; i++){
+      inum = b*IPB + i;
+      if(inum == 0 || inum >= sb.ninodes || inum >= SNAPSHOT_INODE_START)
+        continue;
+      dip = (struct dinode*)bp->data + i;
+      if(dip->type == 0)
+        continue;
+      meta->file_count++;
+      for(j = 0; j < NDIRECT; j++){
+        if(dip->addrs[j] == 0)
+          continue;
+        if(bref_share(dip->addrs[j]) < 0)
+          panic("snapshot_pin: refcount overflow");
+        meta->total_blocks++;
+      }
+      if(dip->indirect){
+        if(bref_share(dip->indirect) < 0)
+          panic("snapshot_pin: refcount overflow");
+        meta->total_blocks++;
+      }
+      // The version chain too, through its newest node.
+      if(dip->version_head && bref_share(dip->version_head) < 0)
+        panic("snapshot_pin: refcount overflow");
+    }
+    brelse(bp);
+  }
+}
+
+// Find a free reserved snapshot inode, or 0 if none.
+static uint
+snapshot_alloc_inum(void)
+{
+  uint inum;
+  struct buf *bp;
+  struct dinode *dip;
+  int type;
+
+  for(inum = SNAPSHOT_INODE_START; inum <= SNAPSHOT_INODE_END && inum < sb.ninodes; inum++){
+    bp = bread(ROOTDEV, IBLOCK(inum, sb));
+    dip = (struct dinode*)bp->data + inum%IPB;
+    type = dip->type;
+    brelse(bp);
+    if(type == 0)
+      return inum;
+  }
+  return 0;
+}
+
+// Look up a snapshot by name. Caller must hold snapshot_lock.
+static struct snapshot*
+snapshot_lookup(char *name)
+{
+  struct snapshot *s;
+
+  for(s = snapshots; s < &snapshots[MAX_SNAPSHOTS]; s++){
+    if(s->inum && strncmp(s->blk.meta.name, name, sizeof(s->blk.meta.name)) == 0)
+      return s;
+  }
+  return 0;
+}
+
+// Create a system-wide snapshot.
+// Returns the new snapshot's id, or -1 on failure.
+int
+snapshot_create(char *name)
+{
+  struct snapshot *s;
+  struct snapshot_metadata *meta;
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum, id;
+
+  begin_op_exclusive();
+
+  acquireread(&snapshot_lock);
+  if(snapshot_lookup(name) != 0){
+    releaseread(&snapshot_lock);
+    end_op();
+    return -1; // Name in use
+  }
+  for(s = snapshots; s < &snapshots[MAX_SNAPSHOTS]; s++){
+    if(s->inum == 0)
+      break;
+  }
+  releaseread(&snapshot_lock);
+
+  if(s == &snapshots[MAX_SNAPSHOTS] || (inum = snapshot_alloc_inum()) == 0){
+    end_op();
+    return -1; // No space
+  }
+  if((s->mblock = balloc(ROOTDEV)) == 0){
+    end_op();
+    return -1; // Disk full
+  }
+
+  // No other FS call is running, so s stays ours until we
+  // publish it by setting s->inum.
+  memset(&s->blk, 0, sizeof(s->blk));
+  meta = &s->blk.meta;
+  safestrcpy(meta->name, name, sizeof(meta->name));
+  meta->timestamp = get_timestamp();
+  meta->id = id = nextid++;
+  meta->root_inum = ROOTINO;
+  meta->creator_pid = myproc()->pid;
+  meta->valid = 1;
+
+  snapshot_pin(meta);
+  snapshot_write(s);
+
+  // Record it in the reserved inode. This change is made
+  // before s becomes newest, so s never copies its own inode.
+  bp = bread(ROOTDEV, IBLOCK(inum, sb));
+  snapshot_cow(bp);
+  dip = (struct dinode*)bp->data + inum%IPB;
+  memset(dip, 0, sizeof(*dip));
+  dip->type = T_SNAP;
+  dip->nlink = 1;
+  dip->size = sizeof(struct snapshot_block);
+  dip->addrs[0] = s->mblock;
+  dip->create_time = meta->timestamp;
+  log_write(bp);
+  brelse(bp);
+
+  acquirewrite(&snapshot_lock);
+  s->inum = inum;
+  newest = s;
+  releasewrite(&snapshot_lock);
+
+  end_op();
+
+  cprintf("Snapshot '%s' created successfully (ID: %d)\n", meta->name, id);
+  return id;
+}
+
+// Fill chain with s followed by every newer snapshot, oldest
+// first. Returns the number of entries.
+// Caller must hold snapshot_lock.
+static int
+snapshot_chain(struct snapshot *s, struct snapshot **chain)
+{
+  struct snapshot *t;
+  int n, k;
+
+  n = 0;
+  chain[n++] = s;
+  for(t = snapshots; t < &snapshots[MAX_SNAPSHOTS]; t++){
+    if(t->inum == 0 || t->blk.meta.id <= s->blk.meta.id)
+      continue;
+    for(k = n; k > 1 && chain[k-1]->blk.meta.id > t->blk.meta.id; k--)
+      chain[k] = chain[k-1];
+    chain[k] = t;
+    n++;
+  }
+  return n;
+}
+
+// Block holding chain[0]'s view of inode block i: the first
+// copy recorded along the chain, or 0 if the live block has
+// not changed since chain[0] was taken.
+static uint
+snapshot_iblock(struct snapshot **chain, int n, uint i)
+{
+  int k;
+
+  for(k = 0; k < n; k++){
+    if(chain[k]->blk.itable[i])
+      return chain[k]->blk.itable[i];
+  }
+  return 0;
+}
+
+// Take a reference on every block a frozen inode points at,
+// since the live inode table is about to point at them too.
+static void
+snapshot_share(struct dinode *dip)
+{
+  int j;
+
+  for(j = 0; j < NDIRECT; j++){
+    if(dip->addrs[j] && bref_share(dip->addrs[j]) < 0)
+      panic("snapshot_share: refcount overflow");
+  }
+  if(dip->indirect && bref_share(dip->indirect) < 0)
+    panic("snapshot_share: refcount overflow");
+  if(dip->version_head && bref_share(dip->version_head) < 0)
+    panic("snapshot_share: refcount overflow");
+}
+
+// Check rolling inode block i back to its copy in fbp.
+// Returns -1 if that would pull an inode out from under a
+// process that has it open, and otherwise the number of
+// version chains it would drop.
+static int
+snapshot_check(struct buf *fbp, uint i)
+{
+  struct buf *bp;
+  struct dinode *live, *old;
+  uint j, inum;
+  int nchain = 0;
+
+  bp = bread(ROOTDEV, sb.inodestart + i);
+  for(j = 0; j < IPB; j++){
+    inum = i*IPB + j;
+    if(inum == 0 || inum >= sb.ninodes || inum >= SNAPSHOT_INODE_START)
+      continue;
+    live = (struct dinode*)bp->data + j;
+    old = (struct dinode*)fbp->data + j;
+    if(live->type != 0 && old->type == 0 && iinuse(ROOTDEV, inum)){
+      nchain = -1;
+      break;
+    }
+    if(live->version_head && memcmp(live, old, sizeof(*live)) != 0)
+      nchain++;
+  }
+  brelse(bp);
+  return nchain;
+}
+
+// Roll the whole file system back to a snapshot.
+// The live inode table is replaced by the snapshot's frozen
+// copy in a single transaction: only inode blocks that changed
+// since the snapshot are rewritten, blocks that only the
+// discarded state referred to are freed, and version chains it
+// alone held are queued for the gc thread. No file data is read
+// or copied. Snapshots newer than the target are kept.
+// Returns 0 on success, -1 if the snapshot does not exist, an
+// inode created after it is still open, or too many inode blocks
+// changed since it to rewrite in one transaction.
+int
+snapshot_restore(char *name)
+{
+  struct snapshot *s, *chain[MAX_SNAPSHOTS];
+  struct buf *bp, *fbp;
+  struct dinode *live, *old;
+  uint from[SNAPSHOT_NIBLOCKS];
+  uint i, j, inum;
+  int n, changed, nchain, r;
+
+  begin_op_exclusive();
+  acquireread(&snapshot_lock);
+  if((s = snapshot_lookup(name)) == 0){
+    releaseread(&snapshot_lock);
+    end_op();
+    return -1;
+  }
+  n = snapshot_chain(s, chain);
+  changed = 0;
+  for(i = 0; i < ninodeblocks; i++){
+    from[i] = snapshot_iblock(chain, n, i);
+    if(from[i])
+      changed++;
+  }
+  releaseread(&snapshot_lock);
+
+  nchain = 0;
+  for(i = 0; i < ninodeblocks; i++){
+    if(from[i] == 0)
+      continue;
+    fbp = bread(ROOTDEV, from[i]);
+    r = snapshot_check(fbp, i);
+    brelse(fbp);
+    if(r < 0){
+      end_op();
+      return -1;
+    }
+    nchain += r;
+  }
+
+  // Each changed inode block is rewritten and may first be
+  // copied for the newest snapshot; add the bitmap block and
+  // that snapshot's own block and the refcount region, and
+  // for queueing dropped version chains on the gc list, each
+  // chain's head node and the superblock.
+  if(2*changed + 2 + sb.nrefblocks + nchain + 1 >= LOGSIZE){
+    end_op();
+    return -1;
+  }
+
+  for(i = 0; i < ninodeblocks; i++){
+    if(from[i] == 0)
+      continue;
+    fbp = bread(ROOTDEV, from[i]);
+    bp = bread(ROOTDEV, sb.inodestart + i);
+    snapshot_cow(bp);
+    for(j = 0; j < IPB; j++){
+      inum = i*IPB + j;
+      if(inum == 0 || inum >= sb.ninodes || inum >= SNAPSHOT_INODE_START)
+        continue;
+      live = (struct dinode*)bp->data + j;
+      old = (struct dinode*)fbp->data + j;
+      if(memcmp(live, old, sizeof(*live)) == 0)
+        continue;
+      // Share before dropping so blocks in both stay allocated.
+      snapshot_share(old);
+      bmapdrop(ROOTDEV, live->addrs, live->indirect);
+      version_release(live->version_head);
+      memmove(live, old, sizeof(*live));
+    }
+    log_write(bp);
+    brelse(bp);
+    brelse(fbp);
+  }
+
+  iinvalidate();
+  end_op();
+  if(nchain)
+    gc_wakeup();
+
+  cprintf("Snapshot '%s' restored\n", s->blk.meta.name);
+  return 0;
+}
+
+//PAGEBREAK!
+// Diffs.
+//
+// Because every block a snapshot or version can see is shared
+// by reference and copied before it is written, two block
+// maps hold the same block number exactly where the content
+// is unchanged. Diffs therefore compare block maps (and, for
+// snapshots, skip inode blocks that resolve to the same disk
+// block) and never read file data.
+
+struct diffstate {
+  struct diff_entry *buf;   // caller's array
+  int max;                  // entries buf can hold
+  int n;                    // ranges found so far
+  struct diff_entry cur;    // range being built
+  int open;                 // is cur in use?
+};
+
+// Record the range in cur, if any.
+static void
+diff_flush(struct diffstate *d)
+{
+  if(!d->open)
+    return;
+  if(d->n < d->max)
+    d->buf[d->n] = d->cur;
+  d->n++;
+  d->open = 0;
+}
+
+// Note whether file block bn differs. Blocks of one file must
+// be passed in increasing order, after cur's file fields are set.
+static void
+diff_block(struct diffstate *d, uint bn, int changed)
+{
+  if(!changed){
+    diff_flush(d);
+    return;
+  }
+  if(d->open && d->cur.start + d->cur.nblocks == bn){
+    d->cur.nblocks++;
+    return;
+  }
+  diff_flush(d);
+  d->cur.start = bn;
+  d->cur.nblocks = 1;
+  d->open = 1;
+}
+
+// Compare block maps a and b of file inum and record changed
+// ranges. A file whose metadata changed but whose blocks did
+// not is recorded as one range of length 0.
+static void
+diff_maps(struct diffstate *d, uint inum, uint type,
+          uint size_a, uint *a, uint ia, uint size_b, uint *b, uint ib)
+{
+  struct buf *bpa, *bpb;
+  uint bn, x, y;
+  int first;
+
+  first = d->n;
+  d->cur.inum = inum;
+  d->cur.type = type;
+  d->cur.size_a = size_a;
+  d->cur.size_b = size_b;
+
+  for(bn = 0; bn < NDIRECT; bn++)
+    diff_block(d, bn, a[bn] != b[bn]);
+
+  if(ia != ib){
+    bpa = ia ? bread(ROOTDEV, ia) : 0;
+    bpb = ib ? bread(ROOTDEV, ib) : 0;
+    for(bn = 0; bn < NINDIRECT; bn++){
+      x = bpa ? ((uint*)bpa->data)[bn] : 0;
+      y = bpb ? ((uint*)bpb->data)[bn] : 0;
+      diff_block(d, NDIRECT + bn, x != y);
+    }
+    if(bpa)
+      brelse(bpa);
+    if(bpb)
+      brelse(bpb);
+  }
+  diff_flush(d);
+
+  if(d->n == first){
+    d->cur.start = 0;
+    d->cur.nblocks = 0;
+    d->open = 1;
+    diff_flush(d);
+  }
+}
+
+// Compare two versions of one inode.
+static void
+diff_dinode(struct diffstate *d, uint inum, struct dinode *a, struct dinode *b)
+{
+  static uint none[NDIRECT];
+  uint type;
+
+  if(a->type == 0 && b->type == 0)
+    return;
+  if(a->type == 0){
+    type = DIFF_ADDED;
+    diff_maps(d, inum, type, 0, none, 0, b->size, b->addrs, b->indirect);
+  } else if(b->type == 0){
+    type = DIFF_REMOVED;
+    diff_maps(d, inum, type, a->size, a->addrs, a->indirect, 0, none, 0);
+  } else {
+    type = DIFF_MODIFIED;
+    diff_maps(d, inum, type, a->size, a->addrs, a->indirect, b->size, b->addrs, b->indirect);
+  }
+}
+
+// Resolve where snapshot name sees each inode block.
+// An empty name means the live file system.
+// Returns -1 if there is no such snapshot.
+static int
+snapshot_iblocks(char *name, uint *iblocks)
+{
+  struct snapshot *s, *chain[MAX_SNAPSHOTS];
+  uint i, b;
+  int n;
+
+  acquireread(&snapshot_lock);
+  s = 0;
+  n = 0;
+  if(*name){
+    if((s = snapshot_lookup(name)) == 0){
+      releaseread(&snapshot_lock);
+      return -1;
+    }
+    n = snapshot_chain(s, chain);
+  }
+  for(i = 0; i < ninodeblocks; i++){
+    b = s ? snapshot_iblock(chain, n, i) : 0;
+    iblocks[i] = b ? b : sb.inodestart + i;
+  }
+  releaseread(&snapshot_lock);
+  return 0;
+}
+
+// List the files and block ranges that differ between
+// snapshots a and b (an empty name means the live file system).
+// Fills up to max entries of buf and returns the total number
+// of ranges, which may exceed max; -1 if a snapshot is unknown.
+int
+snapshot_diff(char *a, char *b, struct diff_entry *buf, int max)
+{
+  uint fa[SNAPSHOT_NIBLOCKS], fb[SNAPSHOT_NIBLOCKS];
+  struct diffstate d;
+  struct buf *bpa, *bpb;
+  struct dinode *da, *db;
+  uint i, j, inum;
+
+  // Keeps snapshot_create() and snapshot_restore() out.
+  begin_op();
+  if(snapshot_iblocks(a, fa) < 0 || snapshot_iblocks(b, fb) < 0){
+    end_op();
+    return -1;
+  }
+
+  memset(&d, 0, sizeof(d));
+  d.buf = buf;
+  d.max = max;
+  for(i = 0; i < ninodeblocks; i++){
+    if(fa[i] == fb[i])
+      continue;  // same inode block, nothing changed
+    bpa = bread(ROOTDEV, fa[i]);
+    bpb = bread(ROOTDEV, fb[i]);
+    for(j = 0; j < IPB; j++){
+      inum = i*IPB + j;
+      if(inum == 0 || inum >= sb.ninodes || inum >= SNAPSHOT_INODE_START)
+        continue;
+      da = (struct dinode*)bpa->data + j;
+      db = (struct dinode*)bpb->data + j;
+      if(memcmp(da, db, sizeof(*da)) != 0)
+        diff_dinode(&d, inum, da, db);
+    }
+    brelse(bpa);
+    brelse(bpb);
+  }
+  end_op();
+  return d.n;
+}
+
+// Fetch the block map of version n of ip (n < 0: ip itself).
+// Caller must hold ip->lock.
+static int
+version_map(struct inode *ip, int n, uint *addrs, uint *size)
+{
+  struct version_node *vnode;
+  uint vblock, k;
+
+  memset(addrs, 0, NDIRECT*sizeof(uint));
+  if(n < 0){
+    memmove(addrs, ip->addrs, NDIRECT*sizeof(uint));
+    *size = ip->size;
+    return 0;
+  }
+
+  vblock = ip->version_head;
+  while(vblock != 0){
+    if((vnode = version_get(vblock)) == 0)
+      break;
+    if(n-- == 0){
+      for(k = 0; k < vnode->nblocks && k < NDIRECT; k++)
+        addrs[k] = vnode->data_blocks[k];
+      *size = vnode->file_size;
+      version_put(vnode);
+      return 0;
+    }
+    vblock = vnode->prev_version;
+    version_put(vnode);
+  }
+  return -1;
+}
+
+// List the block ranges that differ between versions va and vb
+// of ip (a negative number means the current content).
+// Caller must hold ip->lock. Returns like snapshot_diff().
+int
+version_diff(struct inode *ip, int va, int vb, struct diff_entry *buf, int max)
+{
+  uint a[NDIRECT], b[NDIRECT], size_a, size_b;
+  struct diffstate d;
+
+  if(version_map(ip, va, a, &size_a) < 0 || version_map(ip, vb, b, &size_b) < 0)
+    return -1;
+
+  memset(&d, 0, sizeof(d));
+  d.buf = buf;
+  d.max = max;
+  if(size_a != size_b || memcmp(a, b, sizeof(a)) != 0)
+    diff_maps(&d, ip->inum, DIFF_MODIFIED, size_a, a, 0, size_b, b, 0);
+  return d.n;
+}
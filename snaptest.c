@@ -0,0 +1,60 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+// Check that snapshot_restore() brings back the file contents
+// that were current when the snapshot was taken. Snapshots
+// cannot be deleted and each one pins every block live when it
+// was taken, so this is not part of usertests; give every run
+// a new snapshot name.
+
+char buf[16];
+
+void
+fail(char *msg)
+{
+  printf(1, "snaptest: %s\n", msg);
+  unlink("snapf");
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n;
+
+  if(argc != 2){
+    printf(2, "Usage: snaptest <new snapshot name>\n");
+    exit();
+  }
+
+  unlink("snapf");
+  fd = open("snapf", O_CREATE | O_RDWR);
+  if(fd < 0 || write(fd, "old", 3) != 3)
+    fail("cannot write snapf");
+  close(fd);
+  if(snapshot_create(argv[1]) < 0)
+    fail("snapshot_create failed (name in use?)");
+
+  fd = open("snapf", O_RDWR);
+  if(fd < 0 || write(fd, "new", 3) != 3)
+    fail("cannot rewrite snapf");
+  close(fd);
+  if(snapshot_restore(argv[1]) < 0)
+    fail("snapshot_restore failed");
+
+  if((fd = open("snapf", O_RDONLY)) < 0)
+    fail("snapf gone after restore");
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if(n < 0)
+    fail("cannot read snapf after restore");
+  buf[n] = 0;
+  if(strcmp(buf, "old") != 0)
+    fail("wrong contents after restore");
+  unlink("snapf");
+
+  printf(1, "snaptest ok\n");
+  exit();
+}
@@ -1,4 +1,13 @@
 // Mutual exclusion spin locks.
+//
+// Ticket locks: each CPU that wants the lock takes the next
+// ticket and waits until it is served, so CPUs get the lock in
+// the order they asked for it, and while waiting they only read
+// the lock's cache line.
+//
+// Each CPU also keeps statistics for every lock name it uses
+// (all the locks with one name share a slot), so recording them
+// takes no atomic operations. lockstat() adds them up.
 
 #include "types.h"
 #include "defs.h"
@@ -9,12 +18,43 @@
 #include "proc.h"
 #include "spinlock.h"
 
+static struct {
+  uint lock;                            // xchg() lock for names
+  int n;
+  char *name[NLOCKSTAT];
+  struct lockstat cpu[NCPU][NLOCKSTAT];
+} lockstats;
+
+// Find or make the statistics slot for name.
+static int
+statslot(char *name)
+{
+  int i;
+
+  while(xchg(&lockstats.lock, 1) != 0)
+    ;
+  for(i = 0; i < lockstats.n; i++)
+    if(lockstats.name[i] == name ||
+       strncmp(lockstats.name[i], name, LOCKNAME) == 0)
+      break;
+  if(i == lockstats.n){
+    if(i < NLOCKSTAT)
+      lockstats.name[lockstats.n++] = name;
+    else
+      i = -1;
+  }
+  xchg(&lockstats.lock, 0);
+  return i;
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->ticket = 0;
+  lk->serving = 0;
   lk->cpu = 0;
+  lk->stat = statslot(name);
 }
 
 // Acquire the lock.
@@ -24,13 +64,23 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint64 t, spin;
+  uint my;
+
   pushcli(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // The xchg is atomic.
-  while(xchg(&lk->locked, 1) != 0)
-    ;
+  // The fetch-and-add is atomic.
+  my = __sync_fetch_and_add(&lk->ticket, 1);
+  spin = 0;
+  if(*(volatile uint*)&lk->serving != my){
+    t = rdtsc();
+    while(*(volatile uint*)&lk->serving != my)
+      pause();
+    spin = rdtsc() - t;
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,15 +90,35 @@ acquire(struct spinlock *lk)
   // Record info about lock acquisition for debugging.
   lk->cpu = mycpu();
   getcallerpcs(&lk, lk->pcs);
+
+  lk->t0 = rdtsc();
+  if(lk->stat >= 0){
+    st = &lockstats.cpu[lk->cpu - cpus][lk->stat];
+    st->nacquire++;
+    if(spin){
+      st->ncontend++;
+      st->spin += spin;
+    }
+  }
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  struct lockstat *st;
+  uint hold;
+
   if(!holding(lk))
     panic("release");
 
+  if(lk->stat >= 0){
+    st = &lockstats.cpu[lk->cpu - cpus][lk->stat];
+    hold = rdtsc() - lk->t0;
+    if(hold > st->maxhold)
+      st->maxhold = hold;
+  }
+
   lk->pcs[0] = 0;
   lk->cpu = 0;
 
@@ -59,14 +129,40 @@ release(struct spinlock *lk)
   // stores; __sync_synchronize() tells them both not to.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code can't use a C assignment, since it might
-  // not be atomic. A real OS would use C atomics here.
-  asm volatile("movl $0, %0" : "+m" (lk->locked) : );
+  // Serve the next ticket, equivalent to lk->serving++.
+  // Only the holder writes serving, so this needs no lock
+  // prefix, but it must be a single store.
+  asm volatile("incl %0" : "+m" (lk->serving) : );
 
   popcli();
 }
 
+// Copy up to max locks' statistics, summed over the CPUs,
+// into st. Returns the number copied.
+int
+lockstat(struct lockstat *st, int max)
+{
+  struct lockstat *c;
+  int i, j, n;
+
+  n = lockstats.n;
+  if(n > max)
+    n = max;
+  for(i = 0; i < n; i++){
+    memset(&st[i], 0, sizeof(st[i]));
+    safestrcpy(st[i].name, lockstats.name[i], LOCKNAME);
+    for(j = 0; j < ncpu; j++){
+      c = &lockstats.cpu[j][i];
+      st[i].nacquire += c->nacquire;
+      st[i].ncontend += c->ncontend;
+      st[i].spin += c->spin;
+      if(c->maxhold > st[i].maxhold)
+        st[i].maxhold = c->maxhold;
+    }
+  }
+  return n;
+}
+
 // Record the current call stack in pcs[] by following the %ebp chain.
 void
 getcallerpcs(void *v, uint pcs[])
@@ -91,7 +187,7 @@ holding(struct spinlock *lock)
 {
   int r;
   pushcli();
-  r = lock->locked && lock->cpu == mycpu();
+  r = lock->serving != lock->ticket && lock->cpu == mycpu();
   popcli();
   return r;
 }
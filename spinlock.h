@@ -1,11 +1,27 @@
 // Mutual exclusion lock.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint ticket;       // Next ticket to hand out
+  uint serving;      // Ticket of the holder; held if != ticket
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
   uint pcs[10];      // The call stack (an array of program counters)
                      // that locked the lock.
+
+  // For lockstat():
+  int stat;          // Slot in the statistics, or -1.
+  uint64 t0;         // When it was acquired (rdtsc).
 };
 
+// Contention statistics for all the locks with one name.
+#define NLOCKSTAT 48
+#define LOCKNAME  16
+
+struct lockstat {
+  char name[LOCKNAME];
+  uint nacquire;     // Acquisitions
+  uint ncontend;     // Acquisitions that had to wait
+  uint64 spin;       // Cycles spent waiting
+  uint maxhold;      // Longest time held, in cycles
+};
@@ -1,6 +1,7 @@
 #define T_DIR  1   // Directory
 #define T_FILE 2   // File
 #define T_DEV  3   // Device
+#define T_SNAP 4   // Snapshot (reserved inodes only)
 
 struct stat {
   short type;  // Type of file
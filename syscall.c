@@ -109,6 +109,16 @@ extern int sys_snapshot_create(void);
 extern int sys_snapshot_restore(void);
 extern int sys_recover_file(void);
 extern int sys_version_restore(void);
+extern int sys_snapshot_diff(void);
+extern int sys_version_diff(void);
+extern int sys_dedup(void);
+extern int sys_dedup_scan(void);
+extern int sys_retention(void);
+extern int sys_deleted_list(void);
+extern int sys_yield(void);
+extern int sys_setpriority(void);
+extern int sys_setaffinity(void);
+extern int sys_lockstat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -138,6 +148,16 @@ static int (*syscalls[])(void) = {
 [SYS_snapshot_restore] sys_snapshot_restore,
 [SYS_recover_file]   sys_recover_file,
 [SYS_version_restore] sys_version_restore,
+[SYS_snapshot_diff]  sys_snapshot_diff,
+[SYS_version_diff]   sys_version_diff,
+[SYS_dedup]          sys_dedup,
+[SYS_dedup_scan]     sys_dedup_scan,
+[SYS_retention]      sys_retention,
+[SYS_deleted_list]   sys_deleted_list,
+[SYS_yield]          sys_yield,
+[SYS_setpriority]    sys_setpriority,
+[SYS_setaffinity]    sys_setaffinity,
+[SYS_lockstat]       sys_lockstat,
 };
 
 void
@@ -26,3 +26,13 @@
 #define SYS_snapshot_restore 25
 #define SYS_recover_file   26
 #define SYS_version_restore 27
+#define SYS_snapshot_diff  28
+#define SYS_version_diff   29
+#define SYS_dedup          30
+#define SYS_dedup_scan     31
+#define SYS_retention      32
+#define SYS_deleted_list   33
+#define SYS_yield          34
+#define SYS_setpriority    35
+#define SYS_setaffinity    36
+#define SYS_lockstat       37
@@ -187,13 +187,16 @@ sys_unlink(void)
 {
   struct inode *ip, *dp;
   struct dirent de;
-  char name[DIRSIZ], *path;
+  char name[DIRSIZ], *path, full[DELPATH];
   uint off;
+  int named;
 
   if(argstr(0, &path) < 0)
     return -1;
 
   begin_op();
+  // The deleted-file registry knows files by full path.
+  named = fullpath(path, full, sizeof(full)) == 0;
   if((dp = nameiparent(path, name)) == 0){
     end_op();
     return -1;
@@ -216,9 +219,15 @@ sys_unlink(void)
     goto bad;
   }
   
-  // ChronoFS: If file has versions, track it before deletion
+  // ChronoFS: If file has versions, track it before deletion.
+  // Refuse rather than lose them if its path is too long to
+  // record.
   if(ip->type == T_FILE && ip->version_head != 0){
-    add_deleted_file(name, ip->inum, ip->version_head);
+    if(!named){
+      iunlockput(ip);
+      goto bad;
+    }
+    recovery_register_deletion(ip, full);
   }
 
   memset(&de, 0, sizeof(de));
@@ -273,19 +282,30 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
-    dp->nlink++;  // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+      goto fail;
   }
 
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto fail;
+
+  if(type == T_DIR){
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // The disk is full: free ip again.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 int
@@ -530,83 +550,151 @@ sys_snapshot_restore(void)
   if(argstr(0, &desc) < 0)
     return -1;
     
-  // Not implemented yet - placeholder
-  return -1;
+  return snapshot_restore(desc);
 }
 
 int
-sys_recover_file(void)
+sys_snapshot_diff(void)
+{
+  char *a, *b;
+  struct diff_entry *buf;
+  int max;
+
+  if(argstr(0, &a) < 0 || argstr(1, &b) < 0 || argint(3, &max) < 0 || max < 0 ||
+     max > 0x7fffffff/sizeof(*buf) || argptr(2, (void*)&buf, max*sizeof(*buf)) < 0)
+    return -1;
+
+  return snapshot_diff(a, b, buf, max);
+}
+
+int
+sys_version_diff(void)
 {
-  char *name;
+  char *path;
+  int va, vb, max, n;
+  struct diff_entry *buf;
   struct inode *ip;
-  struct version_node *vnode;
-  
-  if(argstr(0, &name) < 0)
+
+  if(argstr(0, &path) < 0 || argint(1, &va) < 0 || argint(2, &vb) < 0 ||
+     argint(4, &max) < 0 || max < 0 || max > 0x7fffffff/sizeof(*buf) ||
+     argptr(3, (void*)&buf, max*sizeof(*buf)) < 0)
     return -1;
-    
-  // Find deleted file info
-  uint vhead = recover_deleted_file(name);
-  if(vhead == 0)
-    return -1; // Not found or not recoverable
-    
+
   begin_op();
-  
-  // Allocate new inode
-  ip = ialloc(ROOTDEV, T_FILE);
-  if(ip == 0){
+  if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
-  
-  ilock(ip);  // Lock the inode before modifying
-  
-  // Explicitly set inode fields
-  ip->type = T_FILE;
-  ip->nlink = 1;
-  
-  // Restore content from version by COPYING blocks (not sharing)
-  vnode = version_get(vhead);
-  if(vnode){
-    ip->size = vnode->file_size;
-    // Don't link to version history - just restore the latest content
-    ip->version_head = 0;
-    
-    // Copy blocks from version (create new blocks with same data)
-    // This avoids reference counting and shared ownership issues
-    for(int i = 0; i < vnode->nblocks && i < NDIRECT; i++){
-      uint new_block = balloc(ip->dev);
-      if(new_block == 0){
-        iunlockput(ip);
-        end_op();
-        return -1;
-      }
-      
-      // Copy data from version block to new block
-      struct buf *src_bp = bread(ip->dev, vnode->data_blocks[i]);
-      struct buf *dst_bp = bread(ip->dev, new_block);
-      memmove(dst_bp->data, src_bp->data, BSIZE);
-      log_write(dst_bp);
-      brelse(dst_bp);
-      brelse(src_bp);
-      
-      ip->addrs[i] = new_block;
-    }
+  ilock(ip);
+  n = version_diff(ip, va, vb, buf, max);
+  iunlockput(ip);
+  end_op();
+  return n;
+}
+
+// Turn inline deduplication on (1) or off (0), or leave it
+// (-1); copy its counters to the struct dedup_stats at the
+// second argument unless it is 0. Returns the old setting.
+int
+sys_dedup(void)
+{
+  int enable, addr;
+  struct dedup_stats *st;
+
+  if(argint(0, &enable) < 0 || argint(1, &addr) < 0)
+    return -1;
+  st = 0;
+  if(addr && argptr(1, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  return dedup_config(enable, st);
+}
+
+// Deduplicate one file, by inode number, and its versions.
+// Returns the number of blocks freed, or -1 once inum is past
+// the end of the inode table.
+int
+sys_dedup_scan(void)
+{
+  int inum;
+
+  if(argint(0, &inum) < 0 || inum < 0)
+    return -1;
+  return dedup_scan(inum);
+}
+
+// Set the retention policy for path's versions, or the global
+// one if path is 0. A 0 policy makes path follow the global
+// one again. The gc thread applies it in the background.
+int
+sys_retention(void)
+{
+  int paddr, raddr;
+  char *path;
+  struct retention *r;
+  struct inode *ip;
+  int err;
+
+  if(argint(0, &paddr) < 0 || argint(1, &raddr) < 0)
+    return -1;
+  r = 0;
+  if(raddr && argptr(1, (void*)&r, sizeof(*r)) < 0)
+    return -1;
+
+  if(paddr == 0){
+    if(r == 0)
+      return -1;
+    retention_set(r);
+    return 0;
   }
-  
-  iupdate(ip);  // Write inode to disk
-  
-  // Create directory entry
-  if(dirlink(namei("."), name, ip->inum) < 0){
-    ip->nlink = 0;
-    iupdate(ip);
-    iunlockput(ip);
+
+  if(argstr(0, &path) < 0)
+    return -1;
+  begin_op();
+  if((ip = namei(path)) == 0){
     end_op();
     return -1;
   }
-  
+  ilock(ip);
+  err = version_setpolicy(ip, r);
   iunlockput(ip);
   end_op();
-  return 0;
+  if(err == 0)
+    gc_wakeup();
+  return err;
+}
+
+// Undelete path: bring back the file last deleted from it.
+int
+sys_recover_file(void)
+{
+  char *path, full[DELPATH];
+  int err;
+
+  if(argstr(0, &path) < 0)
+    return -1;
+  begin_op();
+  err = fullpath(path, full, sizeof(full));
+  end_op();
+  if(err < 0)
+    return -1;
+  return undelete_file(full);
+}
+
+// List the deleted-file registry a page at a time: copy up to
+// max entries into buf, starting at *cursor (0 at first), and
+// advance *cursor. Returns the number copied, 0 at the end.
+int
+sys_deleted_list(void)
+{
+  uint *cursor;
+  struct deleted_entry *buf;
+  int max;
+
+  if(argptr(0, (void*)&cursor, sizeof(*cursor)) < 0 || argint(2, &max) < 0 ||
+     max < 0 || max > 0x7fffffff/sizeof(*buf) ||
+     argptr(1, (void*)&buf, max*sizeof(*buf)) < 0)
+    return -1;
+  return list_deleted(cursor, buf, max);
 }
 
 int
@@ -640,47 +728,17 @@ sys_version_restore(void)
       break;
     
     if(current_version == version_num){
-      // Found the target version - restore it
-      
-      // 1. Free current blocks
-      for(int i = 0; i < NDIRECT; i++){
-        if(ip->addrs[i]){
-          if(bref_is_tracked(ip->addrs[i])){
-             if(bref_dec(ip->addrs[i]) == 0) bfree(ip->dev, ip->addrs[i]);
-          } else {
-             bfree(ip->dev, ip->addrs[i]);
-          }
-          ip->addrs[i] = 0;
-        }
-      }
-      
-      // 2. Restore from version by COPYING blocks (safe)
-      ip->size = vnode->file_size;
-      
-      for(int i = 0; i < vnode->nblocks && i < NDIRECT; i++){
-        // Allocate new block
-        uint newblock = balloc(ip->dev);
-        if(newblock == 0) break; // Should handle error better but panic avoidance
-        
-        // Copy data
-        struct buf *src = bread(ip->dev, vnode->data_blocks[i]);
-        struct buf *dst = bread(ip->dev, newblock);
-        memmove(dst->data, src->data, BSIZE);
-        log_write(dst);
-        brelse(src);
-        brelse(dst);
-        
-        ip->addrs[i] = newblock;
-      }
-      
-      iupdate(ip);
+      // Found the target version - remap ip onto its blocks
+      int r = version_restore(ip, vnode);
+      version_put(vnode);
       iunlockput(ip);
       end_op();
-      return 0;
+      return r;
     }
     
     current_version++;
     vblock = vnode->prev_version;
+    version_put(vnode);
   }
   
   // Version not found
@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
 
 int
 sys_fork(void)
@@ -82,10 +83,55 @@ sys_sleep(void)
 int
 sys_uptime(void)
 {
-  uint xticks;
+  // ticks is one aligned word, so reading it needs no lock.
+  return *(volatile uint*)&ticks;
+}
 
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+// Give up the CPU to another runnable process.
+int
+sys_yield(void)
+{
+  yield();
+  return 0;
+}
+
+// Set a process's base priority, 0 (highest) to NPRIO-1.
+// Returns its old one.
+int
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  if(argint(0, &pid) < 0 || argint(1, &prio) < 0)
+    return -1;
+  return setpriority(pid, prio);
+}
+
+// Pin a process to the CPUs in a mask, a bit per CPU.
+// Returns its old mask.
+int
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+// Copy out spinlock contention statistics, one entry per
+// lock name. Returns the number of entries.
+int
+sys_lockstat(void)
+{
+  struct lockstat *st;
+  int n;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > NLOCKSTAT)
+    n = NLOCKSTAT;
+  if(argptr(0, (void*)&st, n*sizeof(*st)) < 0)
+    return -1;
+  return lockstat(st, n);
 }
@@ -0,0 +1,51 @@
+// Run a command pinned to a set of CPUs.
+//
+//   taskset mask command [args...]
+//
+// mask is in hex, a bit per CPU: taskset 1 sh runs sh, and
+// everything it starts, on CPU 0 only.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+static int
+hex(char *s, uint *v)
+{
+  int d;
+
+  if(s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    s += 2;
+  if(*s == 0)
+    return -1;
+  for(*v = 0; *s; s++){
+    if(*s >= '0' && *s <= '9')
+      d = *s - '0';
+    else if(*s >= 'a' && *s <= 'f')
+      d = *s - 'a' + 10;
+    else if(*s >= 'A' && *s <= 'F')
+      d = *s - 'A' + 10;
+    else
+      return -1;
+    *v = *v * 16 + d;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint mask;
+
+  if(argc < 3 || hex(argv[1], &mask) < 0){
+    printf(2, "usage: taskset mask command [args...]\n");
+    exit();
+  }
+  if(setaffinity(getpid(), mask) < 0){
+    printf(2, "taskset: bad mask %s\n", argv[1]);
+    exit();
+  }
+  exec(argv[2], argv+2);
+  printf(2, "taskset: exec %s failed\n", argv[2]);
+  exit();
+}
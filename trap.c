@@ -11,8 +11,8 @@
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
 extern uint vectors[];  // in vectors.S: array of 256 entry pointers
-struct spinlock tickslock;
-uint ticks;
+struct spinlock tickslock;  // for sleeping on ticks
+uint ticks;                 // written only by CPU 0's timer
 
 void
 tvinit(void)
@@ -53,6 +53,8 @@ trap(struct trapframe *tf)
       ticks++;
       wakeup(&ticks);
       release(&tickslock);
+      if(ticks % BOOSTTICKS == 0)
+        boost();
     }
     lapiceoi();
     break;
@@ -71,6 +73,10 @@ trap(struct trapframe *tf)
     uartintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // Only needs to bring an idle CPU out of hlt.
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n",
@@ -100,10 +106,11 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU on clock tick, once its
+  // time slice is used up.
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
+     tf->trapno == T_IRQ0+IRQ_TIMER && timeslice())
     yield();
 
   // Check if the process has been killed since we yielded
@@ -0,0 +1,44 @@
+// Time truncating a 100-block file.
+// itrunc looks up every block it frees in the block
+// reference count table, so this measures bref lookups.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define NBLOCKS 100
+#define ROUNDS 20
+
+int
+main(int argc, char *argv[])
+{
+  int fd, i, r, t0, ticks;
+  char path[] = "truncbench.tmp";
+  char data[512];
+
+  memset(data, 'a', sizeof(data));
+  ticks = 0;
+  for(r = 0; r < ROUNDS; r++){
+    fd = open(path, O_CREATE | O_RDWR);
+    if(fd < 0){
+      printf(2, "truncbench: cannot create %s\n", path);
+      exit();
+    }
+    for(i = 0; i < NBLOCKS; i++){
+      if(write(fd, data, sizeof(data)) != sizeof(data)){
+        printf(2, "truncbench: write failed\n");
+        exit();
+      }
+    }
+    close(fd);
+
+    t0 = uptime();
+    unlink(path);
+    ticks += uptime() - t0;
+  }
+
+  printf(1, "truncbench: %d truncates of %d blocks in %d ticks\n",
+         ROUNDS, NBLOCKS, ticks);
+  exit();
+}
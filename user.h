@@ -1,5 +1,6 @@
 struct stat;
 struct rtcdate;
+struct lockstat;
 
 // system calls
 int fork(void);
@@ -29,6 +30,16 @@ int snapshot_create(char*);
 int snapshot_restore(char*);
 int recover_file(char*);
 int version_restore(char*, int);
+int snapshot_diff(char*, char*, void*, int);
+int version_diff(char*, int, int, void*, int);
+int dedup(int, void*);
+int dedup_scan(int);
+int retention(char*, void*);
+int deleted_list(uint*, void*, int);
+int yield(void);
+int setpriority(int, int);
+int setaffinity(int, uint);
+int lockstat(struct lockstat*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
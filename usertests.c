@@ -1144,6 +1144,46 @@ bigwrite(void)
   printf(1, "bigwrite ok\n");
 }
 
+// Fill the disk: once nothing more can be reclaimed, write()
+// must fail with -1 rather than hang.
+void
+diskfull(void)
+{
+  char df[4];
+  int fd, i, n, r, blk;
+
+  printf(1, "diskfull test\n");
+
+  df[0] = 'd';
+  df[1] = 'f';
+  df[3] = 0;
+  r = 0;
+  blk = 0;
+  for(n = 0; n < 64 && r >= 0; n++){
+    df[2] = 'a' + n;
+    fd = open(df, O_CREATE | O_RDWR);
+    if(fd < 0)
+      break;
+    for(i = 0; i < MAXFILE; i++){
+      // Make every block different, so none is deduplicated.
+      *(int*)buf = blk++;
+      if((r = write(fd, buf, BSIZE)) != BSIZE)
+        break;
+    }
+    close(fd);
+  }
+  if(r != -1){
+    printf(1, "diskfull: write on a full disk returned %d\n", r);
+    exit();
+  }
+  while(n-- > 0){
+    df[2] = 'a' + n;
+    unlink(df);
+  }
+
+  printf(1, "diskfull ok\n");
+}
+
 void
 bigfile(void)
 {
@@ -1787,6 +1827,7 @@ main(int argc, char *argv[])
   rmdot();
   fourteen();
   bigfile();
+  diskfull();
   subdir();
   linktest();
   unlinkread();
@@ -0,0 +1,101 @@
+// Sleep/wakeup cost, with nidle other processes asleep:
+//  - pipe: bytes a second process moves through a pipe, a block
+//    at a time, each write and read waking the other side;
+//  - lock: fstat() calls from nproc processes on one file,
+//    contending for its inode's sleep-lock.
+//
+//   wakebench [nidle]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+#define PIPEBYTES (512*1024)
+#define NSTAT     4000
+#define NLOCKERS  4
+
+static void
+pipebench(void)
+{
+  char buf[512];
+  int fds[2], n, total, t0;
+
+  if(pipe(fds) < 0){
+    printf(2, "wakebench: pipe failed\n");
+    exit();
+  }
+  memset(buf, 'x', sizeof(buf));
+  t0 = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    for(total = 0; total < PIPEBYTES; total += sizeof(buf))
+      write(fds[1], buf, sizeof(buf));
+    exit();
+  }
+  close(fds[1]);
+  total = 0;
+  while((n = read(fds[0], buf, sizeof(buf))) > 0)
+    total += n;
+  close(fds[0]);
+  wait();
+  printf(1, "pipe: %d bytes in %d ticks\n", total, uptime() - t0);
+}
+
+static void
+lockbench(void)
+{
+  struct stat st;
+  int fd, i, j, t0;
+
+  if((fd = open("wakebench.tmp", O_CREATE | O_RDWR)) < 0){
+    printf(2, "wakebench: cannot create wakebench.tmp\n");
+    exit();
+  }
+  t0 = uptime();
+  for(i = 0; i < NLOCKERS; i++){
+    if(fork() == 0){
+      for(j = 0; j < NSTAT; j++)
+        fstat(fd, &st);
+      exit();
+    }
+  }
+  for(i = 0; i < NLOCKERS; i++)
+    wait();
+  printf(1, "lock: %d procs x %d fstats in %d ticks\n",
+         NLOCKERS, NSTAT, uptime() - t0);
+  close(fd);
+  unlink("wakebench.tmp");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nidle, i, fds[2];
+  char c;
+
+  // Idle processes sleep in read() on a pipe nobody writes.
+  nidle = argc > 1 ? atoi(argv[1]) : 32;
+  if(pipe(fds) < 0){
+    printf(2, "wakebench: pipe failed\n");
+    exit();
+  }
+  for(i = 0; i < nidle; i++){
+    if(fork() == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit();
+    }
+  }
+  close(fds[0]);
+
+  printf(1, "wakebench: %d idle processes\n", nidle);
+  pipebench();
+  lockbench();
+
+  // Closing the write end wakes the idle processes.
+  close(fds[1]);
+  for(i = 0; i < nidle; i++)
+    wait();
+  exit();
+}
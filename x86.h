@@ -117,6 +117,31 @@ sti(void)
   asm volatile("sti");
 }
 
+static inline uint64
+rdtsc(void)
+{
+  uint64 t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+// Hint to the CPU that this is a spin-wait loop.
+static inline void
+pause(void)
+{
+  asm volatile("pause" : : : "memory");
+}
+
+// Enable interrupts and halt until the next one. sti takes
+// effect only after the following instruction, so no interrupt
+// can slip in between and be missed.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {